@@ -1,23 +1,43 @@
-#include <sstream>
 #include "csapp.h"
 #include "message.h"
 #include "connection.h"
 #include <iostream>
 #include <string.h>
+#include <sys/uio.h>
+#include <climits>
 
 using std::to_string;
 using std::cerr;
 using std::string;
-using std::stringstream;
 
 Connection::Connection()
   : m_fd(-1)
-  , m_last_result(SUCCESS) {
+  , m_last_result(SUCCESS)
+  , m_last_error(NO_ERROR)
+  , m_discarding(false)
+  , m_protocol(1)
+  , m_max_payload(DEFAULT_MAX_PAYLOAD)
+  , m_skip(0)
+  , m_assembling(false)
+  , m_large_need(0)
+  , m_nonblocking(false)
+  , m_corked(false)
+  , m_outpos(0) {
 }
 
 Connection::Connection(int fd)
   : m_fd(fd)
-  , m_last_result(SUCCESS) {
+  , m_last_result(SUCCESS)
+  , m_last_error(NO_ERROR)
+  , m_discarding(false)
+  , m_protocol(1)
+  , m_max_payload(DEFAULT_MAX_PAYLOAD)
+  , m_skip(0)
+  , m_assembling(false)
+  , m_large_need(0)
+  , m_nonblocking(false)
+  , m_corked(false)
+  , m_outpos(0) {
   // call rio_readinitb to initialize the rio_t object
   rio_readinitb(&m_fdbuf, m_fd);
 }
@@ -44,46 +64,476 @@ bool Connection::is_open() const {
 
 void Connection::close() {
   if (is_open()) { // use is_open helper function
+    flush(); // whatever can still be written of held back output
     Close(m_fd);
     m_fd = -1; // set the m_fd negative so we know it is closed in future
   }
 }
 
 bool Connection::send(const Message &msg) {
-  // send a message
-  const string message = msg.tag + ":" + msg.data + "\n"; // format message correctly
-  ssize_t status = rio_writen(m_fd, message.c_str(), message.length()); // use rio_writen to send the message
+  return send_parts(msg.tag.data(), msg.tag.size(), msg.data.data(), msg.data.size());
+}
+
+bool Connection::send(const char *tag, const char *data) {
+  return send_parts(tag, strlen(tag), data, strlen(data));
+}
+
+bool Connection::send(const char *tag, const string &data) {
+  return send_parts(tag, strlen(tag), data.data(), data.size());
+}
+
+bool Connection::send_parts(const char *tag, size_t tag_len, const char *data, size_t data_len) {
+  unsigned char header[MAX_VARINT_LEN + 1];
+  int header_len = 0;
+  if (m_protocol == 2) {
+    header_len = encode_header(tag, tag_len, data_len, header);
+    if (header_len < 0) { // the tag has no code, so it can't be framed
+      m_last_result = INVALID_MSG;
+      return false;
+    }
+  }
+
+  if (m_nonblocking || m_corked) { // buffer the encoded message, then write what we can
+    if (!has_pending_output()) { // reuse the buffer once it has been drained
+      m_outbuf.clear();
+      m_outpos = 0;
+    }
+    if (m_protocol == 2) {
+      m_outbuf.append((const char *) header, header_len);
+      m_outbuf.append(data, data_len);
+    } else {
+      m_outbuf.append(tag, tag_len);
+      m_outbuf += ':';
+      m_outbuf.append(data, data_len);
+      m_outbuf += '\n';
+    }
+    if (!m_corked && !flush())
+      return false;
+    m_last_result = SUCCESS;
+    return true;
+  }
+
+  // send a message, gathering its parts rather than formatting it
+  // into a temporary string
+  struct iovec iov[4];
+  int count;
+  if (m_protocol == 2) {
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_len;
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = data_len;
+    count = 2;
+  } else {
+    iov[0].iov_base = (void *) tag;
+    iov[0].iov_len = tag_len;
+    iov[1].iov_base = (void *) ":";
+    iov[1].iov_len = 1;
+    iov[2].iov_base = (void *) data;
+    iov[2].iov_len = data_len;
+    iov[3].iov_base = (void *) "\n";
+    iov[3].iov_len = 1;
+    count = 4;
+  }
 
   // return true if successful, false if not
   // make sure that m_last_result is set appropriately
-  if (status < 0) { // message was not successfully sent
+  if (!writev_all(iov, count)) { // message was not successfully sent
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+  m_last_result = SUCCESS;
+  return true;
+}
+
+// the varint length and tag code that start a version 2 frame, or -1
+// if the tag has no code
+int Connection::encode_header(const char *tag, size_t tag_len, size_t data_len, unsigned char *header) {
+  int code = tag_code(tag, tag_len);
+  if (code == 0)
+    return -1;
+  int len = encode_varint(data_len + 1, header);
+  header[len++] = (unsigned char) code;
+  return len;
+}
+
+// Point iov at a frame in the connection's protocol, returning how many
+// entries were used. A frame that can't be sent as a version 1 line is
+// left out, returning 0.
+int Connection::frame_iov(const Frame &frame, struct iovec *iov) {
+  if (m_protocol == 2) {
+    iov[0].iov_base = (void *) frame.header;
+    iov[0].iov_len = frame.header_len;
+    iov[1].iov_base = (void *) frame.data();
+    iov[1].iov_len = frame.data_size();
+    return 2;
+  }
+  if (!frame.fits_line)
+    return 0;
+  iov[0].iov_base = (void *) frame.bytes();
+  iov[0].iov_len = frame.size();
+  return 1;
+}
+
+void Connection::append_frame(const Frame &frame) {
+  if (m_protocol == 2) {
+    m_outbuf.append((const char *) frame.header, frame.header_len);
+    m_outbuf.append(frame.data(), frame.data_size());
+  } else if (frame.fits_line) {
+    m_outbuf.append(frame.bytes(), frame.size());
+  }
+}
+
+bool Connection::send(const Frame &frame) {
+  if (m_nonblocking || m_corked) {
+    if (!has_pending_output()) {
+      m_outbuf.clear();
+      m_outpos = 0;
+    }
+    append_frame(frame);
+    if (!m_corked && !flush())
+      return false;
+    m_last_result = SUCCESS;
+    return true;
+  }
+
+  // the frame is already in wire format, so write it as is
+  struct iovec iov[2];
+  if (!writev_all(iov, frame_iov(frame, iov))) {
     m_last_result = EOF_OR_ERROR;
     return false;
-  } else { // the message was successfully sent
+  }
+  m_last_result = SUCCESS;
+  return true;
+}
+
+bool Connection::send(const std::vector<FramePtr> &frames) {
+  if (m_nonblocking || m_corked) {
+    if (!has_pending_output()) {
+      m_outbuf.clear();
+      m_outpos = 0;
+    }
+    for (auto &frame : frames)
+      append_frame(*frame);
+    if (!m_corked && !flush())
+      return false;
     m_last_result = SUCCESS;
     return true;
   }
+
+  // gather the frames in place rather than copying them together
+  struct iovec iov[IOV_MAX];
+  size_t next = 0;
+  while (next < frames.size()) {
+    int count = 0;
+    for (; next < frames.size() && count + 2 <= IOV_MAX; next++)
+      count += frame_iov(*frames[next], iov + count);
+    if (!writev_all(iov, count)) {
+      m_last_result = EOF_OR_ERROR;
+      return false;
+    }
+  }
+  m_last_result = SUCCESS;
+  return true;
+}
+
+bool Connection::writev_all(struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t n = writev(m_fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    // skip past whatever was written, which may end mid-buffer
+    while (count > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
 }
 
 bool Connection::receive(Message &msg) {
-  // Receive a message, storing its tag and data in msg
-  char buf[Message::MAX_LEN + 1]; // one extra char for null terminator
+  // Receive a message, storing its tag and data in msg, reading from
+  // the socket only when the buffer doesn't hold a complete line
+  while (true) {
+    ParseStatus status = parse_line(msg);
+    if (status == PARSE_LINE)
+      return true;
+    if (status == PARSE_INVALID)
+      return false;
+    // the peer may be waiting for replies before it sends anything more
+    if (has_pending_output() && !flush())
+      return false;
+    if (!read_some()) { // the peer closed the connection (or the read failed)
+      m_last_result = EOF_OR_ERROR;
+      m_last_error = NO_ERROR;
+      return false;
+    }
+  }
+}
 
-  // return true if successful, false if not
-  // make sure that m_last_result is set appropriately
+Connection::ParseStatus Connection::parse_line(Message &msg) {
+  if (m_protocol == 2)
+    return parse_frame(msg);
+
+  // the part of an overlong line after the first MAX_LEN characters
+  // has already been reported, so drop it up to the newline
+  while (m_discarding) {
+    if (m_fdbuf.rio_cnt <= 0)
+      return PARSE_INCOMPLETE;
+    const char *nl = (const char *) memchr(m_fdbuf.rio_bufptr, '\n', m_fdbuf.rio_cnt);
+    if (nl == nullptr) {
+      consume_input(m_fdbuf.rio_cnt);
+      return PARSE_INCOMPLETE;
+    }
+    consume_input(nl - m_fdbuf.rio_bufptr + 1);
+    m_discarding = false;
+  }
 
-  ssize_t status = rio_readlineb(&m_fdbuf, buf, Message::MAX_LEN); // use rio_readlineb to receive a message
-  
-  if (status < 0) { // there was a failure to receive, so return false
+  size_t avail = m_fdbuf.rio_cnt > 0 ? m_fdbuf.rio_cnt : 0;
+  size_t limit = avail < Message::MAX_LEN ? avail : Message::MAX_LEN;
+  const char *line = m_fdbuf.rio_bufptr;
+  const char *nl = (const char *) memchr(line, '\n', limit);
+  if (nl == nullptr) {
+    if (avail < Message::MAX_LEN)
+      return PARSE_INCOMPLETE; // only part of a line has arrived so far
+    consume_input(limit);
+    m_discarding = true;
     m_last_result = INVALID_MSG;
-    return false;
+    m_last_error = LINE_TOO_LONG;
+    return PARSE_INVALID;
   }
 
-  stringstream sstream(buf);
-  getline(sstream, msg.tag, ':'); // grab tag up to the colon
-  getline(sstream, msg.data); // then, data after the colon
+  // the line stays in the buffer until the next read, so it can be
+  // consumed before it is split
+  size_t len = nl - line;
+  consume_input(len + 1);
+  const char *colon = (const char *) memchr(line, ':', len);
+  if (colon == nullptr) {
+    m_last_result = INVALID_MSG;
+    m_last_error = MISSING_COLON;
+    return PARSE_INVALID;
+  }
+  // assign reuses whatever capacity msg's strings already have
+  msg.tag.assign(line, colon - line);
+  msg.data.assign(colon + 1, nl - (colon + 1));
+  m_last_result = SUCCESS;
+  m_last_error = NO_ERROR;
+  return PARSE_LINE;
+}
+
+Connection::ParseStatus Connection::parse_frame(Message &msg) {
+  if (!skip_input())
+    return PARSE_INCOMPLETE;
+  if (m_assembling)
+    return continue_large_frame(msg);
 
-  // return true as the reception was successful
+  // decode the length, which is all that is needed to find the frame's end
+  const unsigned char *p = (const unsigned char *) m_fdbuf.rio_bufptr;
+  size_t avail = m_fdbuf.rio_cnt > 0 ? m_fdbuf.rio_cnt : 0;
+  uint32_t len = 0;
+  unsigned header_len = 0;
+  while (true) {
+    if (header_len == avail)
+      return PARSE_INCOMPLETE;
+    unsigned char b = p[header_len];
+    if (header_len == MAX_VARINT_LEN - 1 && b > 0x0f) {
+      // not a 32-bit length, and there is no telling where the next
+      // frame starts, so the connection is as good as closed
+      m_last_result = EOF_OR_ERROR;
+      m_last_error = BAD_FRAME;
+      return PARSE_INVALID;
+    }
+    len |= (uint32_t) (b & 0x7f) << (7 * header_len);
+    header_len++;
+    if (!(b & 0x80))
+      break;
+  }
+
+  m_last_result = INVALID_MSG;
+  if (len == 0) {
+    consume_input(header_len);
+    m_last_error = BAD_FRAME;
+    return PARSE_INVALID;
+  }
+  size_t data_len = len - 1;
+  if (data_len > m_max_payload) {
+    consume_input(header_len);
+    m_skip = len;
+    skip_input();
+    m_last_error = LINE_TOO_LONG;
+    return PARSE_INVALID;
+  }
+  if (avail == header_len)
+    return PARSE_INCOMPLETE; // the tag code hasn't arrived yet
+  const char *tag = tag_name(p[header_len]);
+  const char *data = (const char *) p + header_len + 1;
+
+  if (avail >= header_len + len) { // the whole frame is buffered
+    consume_input(header_len + len);
+    if (tag == nullptr) {
+      m_last_error = UNKNOWN_TAG;
+      return PARSE_INVALID;
+    }
+    msg.tag.assign(tag);
+    msg.data.assign(data, data_len);
+    m_last_result = SUCCESS;
+    m_last_error = NO_ERROR;
+    return PARSE_LINE;
+  }
+  if (header_len + len <= RIO_BUFSIZE)
+    return PARSE_INCOMPLETE; // the rest will fit in the buffer once it arrives
+
+  // the frame can never be buffered whole, so collect its data as it arrives
+  consume_input(header_len + 1);
+  if (tag == nullptr) {
+    m_skip = data_len;
+    skip_input();
+    m_last_error = UNKNOWN_TAG;
+    return PARSE_INVALID;
+  }
+  m_assembling = true;
+  m_large.tag.assign(tag);
+  m_large.data.clear();
+  m_large.data.reserve(data_len);
+  m_large_need = data_len;
+  return continue_large_frame(msg);
+}
+
+Connection::ParseStatus Connection::continue_large_frame(Message &msg) {
+  size_t n = m_fdbuf.rio_cnt > 0 ? m_fdbuf.rio_cnt : 0;
+  if (n > m_large_need)
+    n = m_large_need;
+  m_large.data.append(m_fdbuf.rio_bufptr, n);
+  consume_input(n);
+  m_large_need -= n;
+  if (m_large_need > 0)
+    return PARSE_INCOMPLETE;
+  m_assembling = false;
+  msg.tag.swap(m_large.tag);
+  msg.data.swap(m_large.data);
   m_last_result = SUCCESS;
+  m_last_error = NO_ERROR;
+  return PARSE_LINE;
+}
+
+// drop buffered input belonging to a rejected frame, returning true
+// once none is left to drop
+bool Connection::skip_input() {
+  size_t n = m_fdbuf.rio_cnt > 0 ? m_fdbuf.rio_cnt : 0;
+  if (n > m_skip)
+    n = m_skip;
+  consume_input(n);
+  m_skip -= n;
+  return m_skip == 0;
+}
+
+void Connection::set_protocol(int version, size_t max_payload) {
+  m_protocol = version;
+  m_max_payload = max_payload;
+}
+
+void Connection::consume_input(size_t len) {
+  m_fdbuf.rio_bufptr += len;
+  m_fdbuf.rio_cnt -= len;
+}
+
+// move any unread data to the front of the buffer to make room
+void Connection::compact_input() {
+  if (m_fdbuf.rio_bufptr != m_fdbuf.rio_buf) {
+    memmove(m_fdbuf.rio_buf, m_fdbuf.rio_bufptr, m_fdbuf.rio_cnt);
+    m_fdbuf.rio_bufptr = m_fdbuf.rio_buf;
+  }
+}
+
+// read once, blocking, into the free space in the input buffer
+bool Connection::read_some() {
+  compact_input();
+  while (true) {
+    ssize_t n = read(m_fd, m_fdbuf.rio_buf + m_fdbuf.rio_cnt, RIO_BUFSIZE - m_fdbuf.rio_cnt);
+    if (n > 0) {
+      m_fdbuf.rio_cnt += n;
+      return true;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    return false;
+  }
+}
+
+void Connection::set_nonblocking() {
+  int flags = fcntl(m_fd, F_GETFL, 0);
+  fcntl(m_fd, F_SETFL, flags | O_NONBLOCK);
+  m_nonblocking = true;
+}
+
+bool Connection::fill() {
+  compact_input();
+  while (m_fdbuf.rio_cnt < RIO_BUFSIZE) {
+    ssize_t n = read(m_fd, m_fdbuf.rio_buf + m_fdbuf.rio_cnt, RIO_BUFSIZE - m_fdbuf.rio_cnt);
+    if (n > 0) {
+      m_fdbuf.rio_cnt += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return true; // everything available has been read
+    } else { // EOF or a real error
+      m_last_result = EOF_OR_ERROR;
+      return false;
+    }
+  }
+  return true; // buffer is full, the caller will come back for the rest
+}
+
+size_t Connection::feed(const char *data, size_t len) {
+  compact_input();
+  size_t room = RIO_BUFSIZE - m_fdbuf.rio_cnt;
+  if (len > room)
+    len = room;
+  memcpy(m_fdbuf.rio_buf + m_fdbuf.rio_cnt, data, len);
+  m_fdbuf.rio_cnt += len;
+  return len;
+}
+
+void Connection::take_output(std::string &out) {
+  m_outbuf.erase(0, m_outpos);
+  m_outpos = 0;
+  out.clear();
+  out.swap(m_outbuf); // the two buffers trade their capacity back and forth
+}
+
+bool Connection::next_message(Message &msg) {
+  return parse_line(msg) != PARSE_INCOMPLETE;
+}
+
+void Connection::cork() {
+  m_corked = true;
+}
+
+bool Connection::uncork() {
+  m_corked = false;
+  return flush();
+}
+
+bool Connection::flush() {
+  while (has_pending_output()) {
+    ssize_t n = write(m_fd, m_outbuf.data() + m_outpos, m_outbuf.size() - m_outpos);
+    if (n > 0) {
+      m_outpos += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return true; // socket buffer is full, try again when it is writable
+    } else {
+      m_last_result = EOF_OR_ERROR;
+      return false;
+    }
+  }
   return true;
-}
\ No newline at end of file
+}
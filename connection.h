@@ -1,8 +1,11 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <string>
+#include <vector>
 #include "csapp.h"
-struct Message;
+#include "message.h"
+struct iovec;
 
 class Connection {
 public:
@@ -14,6 +17,17 @@ public:
     INVALID_MSG,  // message format was invalid
   };
 
+  // when a receive fails with INVALID_MSG, what was wrong with the line
+  // (or, in protocol version 2, the frame)
+  enum Error {
+    NO_ERROR,
+    MISSING_COLON, // no ':' separates the tag from the data
+    LINE_TOO_LONG, // longer than Message::MAX_LEN, including the newline,
+                   // or data longer than the version 2 payload limit
+    UNKNOWN_TAG,   // a version 2 frame's tag code is not a TagCode
+    BAD_FRAME,     // a version 2 frame has no room for its tag code
+  };
+
   // Default constructor: Connection starts out as not connected,
   // the connect member function must be called to create a connection.
   // This is how a client should connect to the server.
@@ -31,6 +45,7 @@ public:
   void connect(const std::string &hostname, int port);
 
   bool is_open() const;
+  int get_fd() const { return m_fd; }
 
   void close();
 
@@ -41,18 +56,131 @@ public:
   bool send(const Message &msg);
   bool receive(Message &msg);
 
+  // A line that receive (or next_message) rejects as INVALID_MSG has
+  // been consumed entirely, so the next receive starts on the line
+  // after it.
+
+  // Send tag:data without building a Message first. Like send(Message),
+  // the line is written straight from its parts, so nothing is
+  // allocated for it.
+  bool send(const char *tag, const char *data);
+  bool send(const char *tag, const std::string &data);
+
+  // send a message that has already been encoded
+  bool send(const Frame &frame);
+
+  // send several encoded messages with a single writev (or, in
+  // non-blocking mode, a single append to the output buffer)
+  bool send(const std::vector<FramePtr> &frames);
+
   Result get_last_result() const { return m_last_result; }
+  Error get_last_error() const { return m_last_error; }
+
+  // Switch to protocol version 1 (text lines) or 2 (binary frames,
+  // see message.h) for everything sent and received from now on.
+  // Version 2 frames carrying more than max_payload bytes of data are
+  // rejected as LINE_TOO_LONG. In version 1, a Frame that doesn't fit
+  // in a line (which only a version 2 sender can cause) is not sent at all.
+  void set_protocol(int version, size_t max_payload = DEFAULT_MAX_PAYLOAD);
+  int get_protocol() const { return m_protocol; }
+
+  static const size_t DEFAULT_MAX_PAYLOAD = 64 * 1024;
+
+  // Non-blocking operation, used by the event loop. Once the socket
+  // is switched to non-blocking mode, send appends the encoded message
+  // to an output buffer and writes as much of it as the socket will
+  // accept; whatever is left is written by later calls to flush.
+  void set_nonblocking();
+  bool is_nonblocking() const { return m_nonblocking; }
+
+  // While the connection is corked, send only adds to the output
+  // buffer, so the replies to a run of pipelined requests can go out
+  // in one write. Held back output is written by flush and uncork, by
+  // a blocking receive before it waits for more input, and by close.
+  void cork();
+  bool uncork();
+
+  // Read whatever data is currently available on the socket into the
+  // input buffer. Returns false (with m_last_result set to
+  // EOF_OR_ERROR) once the peer has closed the connection or the read
+  // failed; messages already buffered can still be extracted.
+  bool fill();
+
+  // Copy data that was read from the socket by other means (such as
+  // io_uring) into the input buffer, returning how much of it fit.
+  size_t feed(const char *data, size_t len);
+  // Record that the peer closed the connection (or reading from it
+  // failed), as fill does when it reaches EOF.
+  void feed_eof() { m_last_result = EOF_OR_ERROR; }
+
+  // Move all unwritten output into out, for the caller to write.
+  void take_output(std::string &out);
+
+  // Extract the next complete line from the input buffer without
+  // reading from the socket. Returns false if no complete line is
+  // buffered. A malformed line is consumed and returns true, with
+  // get_last_result() reporting INVALID_MSG.
+  bool next_message(Message &msg);
+
+  // Write as much pending output as the socket will accept.
+  // Returns false if the write failed.
+  bool flush();
+  bool has_buffered_input() const { return m_fdbuf.rio_cnt > 0; }
+  // true if fill stopped because the input buffer is full, rather than
+  // because it read everything available
+  bool is_input_full() const { return m_fdbuf.rio_cnt == RIO_BUFSIZE; }
+  bool has_pending_output() const { return m_outpos < m_outbuf.size(); }
+  size_t pending_output() const { return m_outbuf.size() - m_outpos; }
 
 private:
   // prohibit value semantics
   Connection(const Connection &);
   Connection &operator=(const Connection &);
 
+  enum ParseStatus {
+    PARSE_LINE,       // msg holds the next message
+    PARSE_INCOMPLETE, // the rest of the line has not arrived yet
+    PARSE_INVALID,    // a malformed line was consumed
+  };
+
+  // split the next buffered line into msg in place, without copying
+  // it out of the input buffer first
+  ParseStatus parse_line(Message &msg);
+  ParseStatus parse_frame(Message &msg);
+  ParseStatus continue_large_frame(Message &msg);
+  bool skip_input();
+  int encode_header(const char *tag, size_t tag_len, size_t data_len, unsigned char *header);
+  int frame_iov(const Frame &frame, struct iovec *iov);
+  void append_frame(const Frame &frame);
+  void consume_input(size_t len);
+  void compact_input();
+  bool read_some();
+
+  // write tag:data\n with one writev, or append it to the output
+  // buffer in non-blocking mode
+  bool send_parts(const char *tag, size_t tag_len, const char *data, size_t data_len);
+  // write all of iov, however many calls it takes
+  bool writev_all(struct iovec *iov, int count);
+
   // these are the recommended member variables for the
   // Connection class
   int m_fd;
   rio_t m_fdbuf; // used to allow buffered input
   Result m_last_result;
+  Error m_last_error;
+  bool m_discarding; // skipping the rest of an overlong line
+  int m_protocol;
+  size_t m_max_payload;
+  size_t m_skip; // bytes of an oversized version 2 frame still to skip
+  // A version 2 frame too large to ever fit in the input buffer is
+  // assembled in m_large as it arrives, m_large_need bytes to go.
+  bool m_assembling;
+  Message m_large;
+  size_t m_large_need;
+  bool m_nonblocking;
+  bool m_corked;
+  std::string m_outbuf; // output not yet written (non-blocking mode)
+  size_t m_outpos;      // offset of the first unwritten byte in m_outbuf
 };
 
 #endif // CONNECTION_H
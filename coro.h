@@ -0,0 +1,111 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+// CoTask<T> is the type of a coroutine that produces a T (or nothing).
+// It does not start until it is awaited, and when it finishes it
+// resumes whoever awaited it, so coroutines can call one another as
+// plainly as functions:
+//
+//   CoTask<bool> receive(Message &msg);
+//   ...
+//   bool received = co_await receive(msg);
+//
+// (GCC 12 miscompiles a co_await in the condition of an if statement:
+// the coroutine never runs. Await into a variable first, as above.)
+//
+// A coroutine that nobody awaits (such as the one serving a client) is
+// started with start_detached and frees itself when it finishes.
+//
+// A CoTask that finishes without suspending resumes its caller from
+// inside its own final suspension. Unless the compiler turns that into
+// a tail call, which an unoptimized build doesn't, the caller carries
+// on a few stack frames deeper. So a loop that may go round many times
+// without suspending (over a client's pipelined requests, say) must not
+// await a CoTask on each pass, or the stack grows until it overflows;
+// awaiting CoroExecutor::wait is fine.
+
+// what every CoTask's promise has in common
+struct CoPromiseBase {
+  std::coroutine_handle<> continuation; // the awaiting coroutine
+  bool detached = false;
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+      CoPromiseBase &promise = h.promise();
+      if (promise.continuation)
+        return promise.continuation; // the caller's CoTask frees the frame
+      if (promise.detached)
+        h.destroy();
+      return std::noop_coroutine();
+    }
+    void await_resume() noexcept { }
+  };
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  // the server doesn't use exceptions for control flow
+  void unhandled_exception() { std::terminate(); }
+};
+
+template <typename T>
+struct CoPromise : CoPromiseBase {
+  T value;
+  void return_value(T v) { value = std::move(v); }
+};
+
+template <>
+struct CoPromise<void> : CoPromiseBase {
+  void return_void() { }
+};
+
+template <typename T = void>
+class CoTask {
+public:
+  struct promise_type : CoPromise<T> {
+    CoTask get_return_object() {
+      return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+  };
+
+  CoTask(CoTask &&other) : m_handle(other.m_handle) { other.m_handle = nullptr; }
+  ~CoTask() {
+    if (m_handle)
+      m_handle.destroy();
+  }
+
+  // awaiting a CoTask runs it until it finishes
+  bool await_ready() const { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+    m_handle.promise().continuation = caller;
+    return m_handle;
+  }
+  T await_resume() {
+    if constexpr (!std::is_void<T>::value)
+      return std::move(m_handle.promise().value);
+  }
+
+  // run until the first suspension; the coroutine frees itself when it ends
+  void start_detached() {
+    std::coroutine_handle<promise_type> handle = m_handle;
+    m_handle = nullptr;
+    handle.promise().detached = true;
+    handle.resume();
+  }
+
+private:
+  explicit CoTask(std::coroutine_handle<promise_type> handle) : m_handle(handle) { }
+  CoTask(const CoTask &);
+  CoTask &operator=(const CoTask &);
+
+  std::coroutine_handle<promise_type> m_handle;
+};
+
+#endif // CORO_H
@@ -0,0 +1,182 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <iostream>
+#include "message_queue.h"
+#include "guard.h"
+#include "coro.h"
+#include "coro_session.h"
+#include "coro_executor.h"
+
+using std::cerr;
+
+// maximum number of events handled per call to epoll_wait
+static const int MAX_EVENTS = 256;
+
+CoroExecutor::CoroExecutor(Server *server)
+  : m_server(server), m_epfd(-1), m_wakefd(-1) {
+  pthread_mutex_init(&m_lock, nullptr);
+}
+
+CoroExecutor::~CoroExecutor() {
+  // the executor threads run for the life of the server, so there is
+  // nothing to join; just release the descriptors
+  if (m_wakefd >= 0)
+    close(m_wakefd);
+  if (m_epfd >= 0)
+    close(m_epfd);
+  pthread_mutex_destroy(&m_lock);
+}
+
+bool CoroExecutor::start() {
+  m_epfd = epoll_create1(EPOLL_CLOEXEC);
+  m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_epfd < 0 || m_wakefd < 0) {
+    cerr << "Failed to create coroutine executor\n";
+    return false;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr; // a null pointer identifies the wakeup descriptor
+  if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev) < 0) {
+    cerr << "Failed to register executor wakeup\n";
+    return false;
+  }
+  if (pthread_create(&m_thread, nullptr, run, this) != 0) {
+    cerr << "Failed to create executor thread\n";
+    return false;
+  }
+  pthread_detach(m_thread);
+  return true;
+}
+
+void CoroExecutor::add_connection(int fd) {
+  {
+    Guard guard(m_lock);
+    m_incoming.push_back(fd);
+  }
+  wake();
+}
+
+void *CoroExecutor::run(void *arg) {
+  static_cast<CoroExecutor *>(arg)->loop();
+  return nullptr;
+}
+
+// Called on a sender's thread when a receiver's queue becomes non-empty.
+// Only the first queue to become ready since the executor last looked
+// wakes it.
+void CoroExecutor::notify_ready(void *arg, MessageQueue *queue) {
+  CoroExecutor *executor = static_cast<CoroExecutor *>(arg);
+  bool first;
+  {
+    Guard guard(executor->m_lock);
+    first = executor->m_ready.empty();
+    executor->m_ready.push_back(queue);
+  }
+  if (first)
+    executor->wake();
+}
+
+void CoroExecutor::loop() {
+  struct epoll_event events[MAX_EVENTS];
+  while (true) {
+    int n = epoll_wait(m_epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      cerr << "epoll_wait failed\n";
+      return;
+    }
+    for (int i = 0; i < n; i++) {
+      Watch *watch = static_cast<Watch *>(events[i].data.ptr);
+      if (watch == nullptr) { // woken by an acceptor or a sender
+        handle_wake();
+        continue;
+      }
+      unsigned ready = 0;
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        ready |= READABLE;
+      if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+        ready |= WRITABLE;
+      post(watch, ready);
+    }
+    for (Watch *watch : m_closed)
+      delete watch;
+    m_closed.clear();
+  }
+}
+
+void CoroExecutor::wake() {
+  uint64_t one = 1;
+  ssize_t rc = write(m_wakefd, &one, sizeof(one));
+  (void) rc; // the counter can only fail to increase if it is already nonzero
+}
+
+void CoroExecutor::handle_wake() {
+  uint64_t count;
+  while (read(m_wakefd, &count, sizeof(count)) > 0)
+    ;
+  std::vector<int> incoming;
+  {
+    Guard guard(m_lock);
+    incoming.swap(m_incoming);
+    m_ready_batch.swap(m_ready);
+  }
+  for (int fd : incoming)
+    serve_client_coroutine(*this, m_server, fd).start_detached();
+  for (MessageQueue *queue : m_ready_batch) {
+    auto it = m_queues.find(queue);
+    if (it != m_queues.end()) // otherwise its receiver has gone
+      post(it->second, DELIVERIES);
+  }
+  m_ready_batch.clear();
+}
+
+// record that events happened, resuming the coroutine if it waits for them
+void CoroExecutor::post(Watch *watch, unsigned events) {
+  if (watch->closed)
+    return;
+  watch->ready |= events;
+  if (watch->waiter && (watch->ready & watch->wanted)) {
+    std::coroutine_handle<> waiter = watch->waiter;
+    watch->waiter = nullptr;
+    waiter.resume();
+  }
+}
+
+CoroExecutor::Watch *CoroExecutor::watch(int fd) {
+  Watch *watch = new Watch();
+  watch->fd = fd;
+  watch->ready = watch->wanted = 0;
+  watch->queue = nullptr;
+  watch->closed = false;
+  // registered once, edge-triggered: readiness is only reported when
+  // it changes, and the coroutine only waits after running out of
+  // input or room
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = watch;
+  if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    delete watch;
+    return nullptr;
+  }
+  return watch;
+}
+
+void CoroExecutor::watch_queue(Watch *watch, MessageQueue *queue) {
+  watch->queue = queue;
+  m_queues[queue] = watch;
+  queue->set_notify(notify_ready, this);
+  // anything queued before the notification was set must be delivered too
+  watch->ready |= DELIVERIES;
+}
+
+void CoroExecutor::unwatch(Watch *watch) {
+  watch->closed = true;
+  epoll_ctl(m_epfd, EPOLL_CTL_DEL, watch->fd, nullptr);
+  if (watch->queue != nullptr)
+    m_queues.erase(watch->queue);
+  m_closed.push_back(watch);
+}
@@ -0,0 +1,108 @@
+#ifndef CORO_EXECUTOR_H
+#define CORO_EXECUTOR_H
+
+#include <coroutine>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+
+class Server;
+class MessageQueue;
+
+// A CoroExecutor is a thread that runs the coroutines serving many
+// client connections (see coro_session.h). A coroutine waits for its
+// socket, or its receiver's queue, with co_await executor.wait(...);
+// the executor resumes it from its epoll loop once what it waits for
+// has happened, so the session code reads like the blocking version
+// while one thread multiplexes thousands of sessions.
+class CoroExecutor {
+public:
+  // what a coroutine can wait for
+  enum {
+    READABLE = 1,   // the socket has input (or has been closed)
+    WRITABLE = 2,   // the socket has room for output
+    DELIVERIES = 4, // the receiver's queue has become non-empty (or closed)
+  };
+
+  // One client connection's registration with the executor. Socket
+  // readiness is edge-triggered, so ready remembers what has happened
+  // since the coroutine last looked.
+  struct Watch {
+    int fd;
+    unsigned ready;  // events that occurred and haven't been waited for
+    unsigned wanted; // what the suspended coroutine waits for
+    std::coroutine_handle<> waiter;
+    MessageQueue *queue;
+    bool closed;
+  };
+
+  // Suspends the calling coroutine until one of the events happens,
+  // returning those that did.
+  class Wait {
+  public:
+    Wait(Watch *watch, unsigned events) : m_watch(watch), m_events(events) { }
+    bool await_ready() const { return (m_watch->ready & m_events) != 0; }
+    void await_suspend(std::coroutine_handle<> h) {
+      m_watch->waiter = h;
+      m_watch->wanted = m_events;
+    }
+    unsigned await_resume() {
+      unsigned fired = m_watch->ready & m_events;
+      m_watch->ready &= ~fired;
+      return fired;
+    }
+  private:
+    Watch *m_watch;
+    unsigned m_events;
+  };
+
+  CoroExecutor(Server *server);
+  ~CoroExecutor();
+
+  // create the epoll instance and start the executor thread
+  bool start();
+
+  // Hand an accepted non-blocking socket to this executor, which
+  // starts a coroutine to serve it. Safe to call from any thread.
+  void add_connection(int fd);
+
+  // Only on the executor thread: register a socket (and later its
+  // receiver's queue), and unregister it once the coroutine is done.
+  Watch *watch(int fd);
+  void watch_queue(Watch *watch, MessageQueue *queue);
+  void unwatch(Watch *watch);
+
+  Wait wait(Watch *watch, unsigned events) { return Wait(watch, events); }
+
+private:
+  // prohibit value semantics
+  CoroExecutor(const CoroExecutor &);
+  CoroExecutor &operator=(const CoroExecutor &);
+
+  static void *run(void *arg);
+  static void notify_ready(void *arg, MessageQueue *queue);
+  void loop();
+  void wake();
+  void handle_wake();
+  void post(Watch *watch, unsigned events);
+
+  Server *m_server;
+  int m_epfd;
+  int m_wakefd; // eventfd used to wake the executor from other threads
+  pthread_t m_thread;
+
+  pthread_mutex_t m_lock; // protects m_incoming and m_ready
+  std::vector<int> m_incoming;
+  std::vector<MessageQueue *> m_ready; // queues that became non-empty
+
+  // the receivers' queues, so a notification for a queue whose
+  // receiver has gone already can be recognized and ignored
+  std::unordered_map<MessageQueue *, Watch *> m_queues;
+  std::vector<MessageQueue *> m_ready_batch; // reused by handle_wake
+
+  // watches unregistered during the current iteration, deleted at its
+  // end so that later events in the same batch never see a freed Watch
+  std::vector<Watch *> m_closed;
+};
+
+#endif // CORO_EXECUTOR_H
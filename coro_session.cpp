@@ -0,0 +1,183 @@
+#include <iostream>
+#include "message.h"
+#include "connection.h"
+#include "session.h"
+#include "user.h"
+#include "server.h"
+#include "coro_executor.h"
+#include "coro_session.h"
+
+using std::cerr;
+
+// stop moving deliveries into a receiver's output buffer once this
+// much is waiting for the socket; the rest stays in its queue
+static const size_t OUTPUT_HIGH_WATER = 64 * 1024;
+
+namespace {
+  // A non-blocking Connection as a coroutine sees it: where the
+  // blocking Connection would block the thread, these suspend the
+  // coroutine until the executor sees the socket ready.
+  class CoConnection {
+  public:
+    CoConnection(CoroExecutor &executor, Connection &conn)
+      : m_executor(executor), m_conn(conn)
+      , m_watch(executor.watch(conn.get_fd())), m_eof(false) { }
+    ~CoConnection() {
+      if (m_watch != nullptr)
+        m_executor.unwatch(m_watch);
+    }
+
+    bool is_watched() const { return m_watch != nullptr; }
+    Connection &conn() { return m_conn; }
+
+    void watch_queue(MessageQueue *queue) { m_executor.watch_queue(m_watch, queue); }
+    CoroExecutor::Wait wait(unsigned events) { return m_executor.wait(m_watch, events); }
+
+    // Read whatever has arrived. Readiness is edge-triggered, so if the
+    // input buffer filled up before the socket was drained, remember
+    // that there is more to read.
+    bool fill() {
+      if (!m_conn.fill())
+        return false;
+      if (m_conn.is_input_full())
+        m_watch->ready |= CoroExecutor::READABLE;
+      return true;
+    }
+
+    // The next message if one is already buffered (or the connection
+    // has ended): returns true, with received false if the message was
+    // bad or there was none. Never suspends, so a loop over pipelined
+    // requests runs in one coroutine frame (see coro.h).
+    bool try_receive(Message &msg, bool &received) {
+      if (m_conn.next_message(msg)) {
+        received = m_conn.get_last_result() == Connection::SUCCESS;
+        return true;
+      }
+      if (m_eof) {
+        m_conn.feed_eof();
+        received = false;
+        return true;
+      }
+      return false;
+    }
+
+    void fill_or_eof() {
+      if (!fill())
+        m_eof = true; // the messages before EOF still count
+    }
+
+    // write all pending output
+    CoTask<bool> flush() {
+      while (true) {
+        if (!m_conn.flush())
+          co_return false;
+        if (!m_conn.has_pending_output())
+          co_return true;
+        co_await wait(CoroExecutor::WRITABLE);
+      }
+    }
+
+  private:
+    CoroExecutor &m_executor;
+    Connection &m_conn;
+    CoroExecutor::Watch *m_watch;
+    bool m_eof;
+  };
+
+  // relay deliveries to a receiver
+  // (the session has already handled the receiver's join)
+  CoTask<void> r_chat(Session &session, CoConnection &c) {
+    c.watch_queue(&session.get_user()->mqueue);
+    while (true) {
+      session.deliver_queued(OUTPUT_HIGH_WATER);
+      if (session.is_done())
+        break;
+      // Wait for more deliveries, for the receiver to hang up, and, if
+      // output is waiting, for room to write it. A hang-up shows up
+      // right away instead of on the next failed send.
+      unsigned events = CoroExecutor::READABLE | CoroExecutor::DELIVERIES;
+      if (c.conn().has_pending_output())
+        events |= CoroExecutor::WRITABLE;
+      unsigned fired = co_await c.wait(events);
+      if ((fired & CoroExecutor::WRITABLE) && !c.conn().flush())
+        break; // the receiver is gone
+      if (fired & CoroExecutor::READABLE) {
+        bool open = c.fill();
+        session.handle_buffered_input(); // a receiver may only poll
+        if (!open)
+          session.handle_receive_error();
+      }
+    }
+    session.leave_room(); // no further deliveries
+  }
+
+  bool logging_in(Session::State state) {
+    return state == Session::LOGIN || state == Session::RECEIVER_JOIN;
+  }
+
+  bool sending(Session::State state) {
+    return state == Session::SENDER;
+  }
+
+  // Handle the client's requests for as long as the session's state is
+  // one in_phase accepts. A client may pipeline requests without
+  // waiting for each reply, so the replies to everything that arrived
+  // together are written at once before waiting for more. Buffered
+  // requests are taken with try_receive, and only the executor's Wait
+  // is awaited here; it doesn't suspend if what it waits for has
+  // already happened, and adds no stack frame either way. So however
+  // many requests arrive at once, they are handled in this one frame
+  // (see coro.h).
+  CoTask<void> handle_requests(Session &session, CoConnection &c, bool (*in_phase)(Session::State)) {
+    Message msg;
+    while (in_phase(session.get_state())) {
+      bool received;
+      if (c.try_receive(msg, received)) {
+        if (!received)
+          session.handle_receive_error();
+        else
+          session.handle_message(msg);
+        continue;
+      }
+      // everything buffered has been handled: write the replies, then
+      // wait for more
+      if (!c.conn().flush())
+        session.handle_receive_error();
+      else if (c.conn().has_pending_output())
+        co_await c.wait(CoroExecutor::WRITABLE);
+      else {
+        co_await c.wait(CoroExecutor::READABLE);
+        c.fill_or_eof();
+      }
+    }
+  }
+
+  // handle a sender's requests until it quits or the connection fails
+  CoTask<void> s_chat(Session &session, CoConnection &c) {
+    c.conn().cork(); // (replies are written by handle_requests)
+    co_await handle_requests(session, c, sending);
+    co_await c.flush(); // e.g. the reply to quit
+  }
+}
+
+CoTask<void> serve_client_coroutine(CoroExecutor &executor, Server *server, int fd) {
+  {
+    Connection conn(fd);
+    conn.set_nonblocking();
+    Session session(server, &conn);
+    CoConnection c(executor, conn);
+    if (!c.is_watched()) {
+      cerr << "Failed to register client connection\n";
+    } else {
+      // the login (and a receiver's join)
+      co_await handle_requests(session, c, logging_in);
+
+      if (session.get_state() == Session::RECEIVER) {
+        co_await r_chat(session, c);
+      } else if (session.get_state() == Session::SENDER) {
+        co_await s_chat(session, c);
+      }
+    }
+  } // the session leaves its room, then the connection closes
+  server->connection_closed();
+}
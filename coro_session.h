@@ -0,0 +1,15 @@
+#ifndef CORO_SESSION_H
+#define CORO_SESSION_H
+
+#include "coro.h"
+
+class Server;
+class CoroExecutor;
+
+// Serve one client on a CoroExecutor, from login until it leaves: the
+// coroutine counterpart of the threaded mode's r_chat and s_chat loops,
+// driving the same Session. fd is a non-blocking socket that the
+// coroutine owns.
+CoTask<void> serve_client_coroutine(CoroExecutor &executor, Server *server, int fd);
+
+#endif // CORO_SESSION_H
@@ -0,0 +1,248 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <iostream>
+#include "message.h"
+#include "connection.h"
+#include "session.h"
+#include "user.h"
+#include "guard.h"
+#include "server.h"
+#include "event_loop.h"
+
+using std::cerr;
+
+// stop moving deliveries into a receiver's output buffer once this
+// much is waiting for the socket; the rest stays in its queue
+static const size_t OUTPUT_HIGH_WATER = 64 * 1024;
+
+// maximum number of events handled per call to epoll_wait
+static const int MAX_EVENTS = 256;
+
+// Each descriptor registered with epoll points at a Watch, which
+// says which channel it belongs to and whether it is the socket or
+// the receiver's queue.
+struct Watch {
+  Channel *ch;
+  bool is_queue;
+  uint32_t events; // events currently registered with epoll
+};
+
+// everything the event loop knows about one client connection
+struct Channel {
+  Connection conn;
+  Session session;
+  Watch sock;
+  Watch queue;
+  bool queue_registered; // set once the receiver has joined its room
+  bool closed;
+
+  Channel(Server *server, int fd)
+    : conn(fd), session(server, &conn), queue_registered(false), closed(false) {
+    sock.ch = queue.ch = this;
+    sock.is_queue = false;
+    queue.is_queue = true;
+    sock.events = queue.events = 0;
+  }
+};
+
+EventLoop::EventLoop(Server *server)
+  : m_server(server), m_epfd(-1), m_wakefd(-1) {
+  pthread_mutex_init(&m_lock, nullptr);
+}
+
+EventLoop::~EventLoop() {
+  // the loop threads run for the life of the server, so there is
+  // nothing to join; just release the descriptors
+  if (m_wakefd >= 0)
+    close(m_wakefd);
+  if (m_epfd >= 0)
+    close(m_epfd);
+  pthread_mutex_destroy(&m_lock);
+}
+
+bool EventLoop::start() {
+  m_epfd = epoll_create1(EPOLL_CLOEXEC);
+  m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_epfd < 0 || m_wakefd < 0) {
+    cerr << "Failed to create event loop\n";
+    return false;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr; // a null pointer identifies the wakeup descriptor
+  if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev) < 0) {
+    cerr << "Failed to register event loop wakeup\n";
+    return false;
+  }
+  if (pthread_create(&m_thread, nullptr, run, this) != 0) {
+    cerr << "Failed to create event loop thread\n";
+    return false;
+  }
+  pthread_detach(m_thread);
+  return true;
+}
+
+void EventLoop::add_connection(int fd) {
+  {
+    Guard guard(m_lock);
+    m_incoming.push_back(fd);
+  }
+  wake();
+}
+
+void *EventLoop::run(void *arg) {
+  static_cast<EventLoop *>(arg)->loop();
+  return nullptr;
+}
+
+void EventLoop::loop() {
+  struct epoll_event events[MAX_EVENTS];
+  while (true) {
+    int n = epoll_wait(m_epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      cerr << "epoll_wait failed\n";
+      return;
+    }
+    for (int i = 0; i < n; i++) {
+      Watch *watch = static_cast<Watch *>(events[i].data.ptr);
+      if (watch == nullptr) { // woken by the acceptor
+        uint64_t count;
+        while (read(m_wakefd, &count, sizeof(count)) > 0)
+          ;
+        accept_incoming();
+        continue;
+      }
+      Channel *ch = watch->ch;
+      if (ch->closed)
+        continue;
+      if (watch->is_queue) { // the receiver has deliveries waiting
+        deliver(ch);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT)
+        handle_output(ch);
+      if (!ch->closed && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        handle_input(ch);
+    }
+    reap_closed();
+  }
+}
+
+void EventLoop::wake() {
+  uint64_t one = 1;
+  ssize_t rc = write(m_wakefd, &one, sizeof(one));
+  (void) rc; // the counter can only fail to increase if it is already nonzero
+}
+
+void EventLoop::accept_incoming() {
+  std::vector<int> incoming;
+  {
+    Guard guard(m_lock);
+    incoming.swap(m_incoming);
+  }
+  for (int fd : incoming) {
+    Channel *ch = new Channel(m_server, fd);
+    ch->conn.set_nonblocking();
+    ch->sock.events = EPOLLIN | EPOLLRDHUP;
+    struct epoll_event ev;
+    ev.events = ch->sock.events;
+    ev.data.ptr = &ch->sock;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      cerr << "Failed to register client connection\n";
+      delete ch;
+      m_server->connection_closed();
+    }
+  }
+}
+
+void EventLoop::handle_input(Channel *ch) {
+  bool open = ch->conn.fill();
+
+  // handle every complete message that has arrived, writing the
+  // replies to all of them together
+  ch->conn.cork();
+  if (ch->session.handle_buffered_input()) {
+    // The receiver has joined its room: from now on its queue wakes
+    // us. The queue is edge-triggered, because its eventfd stays
+    // readable while deliveries wait for the socket to drain (which
+    // EPOLLOUT reports), but it is signalled again if it is closed.
+    ch->queue.events = EPOLLIN | EPOLLET;
+    ch->queue_registered = true;
+    struct epoll_event ev;
+    ev.events = ch->queue.events;
+    ev.data.ptr = &ch->queue;
+    epoll_ctl(m_epfd, EPOLL_CTL_ADD, ch->session.get_user()->mqueue.get_fd(), &ev);
+  }
+  if (!ch->conn.uncork()) { // the client can't be reached any more
+    close_channel(ch);
+    return;
+  }
+  if (!open && !ch->session.is_done()) {
+    // treat EOF as a failed receive, exactly like the blocking mode does
+    ch->session.handle_receive_error();
+  }
+  if (ch->session.is_done())
+    close_channel(ch);
+  else
+    update_events(ch);
+}
+
+void EventLoop::handle_output(Channel *ch) {
+  if (!ch->conn.flush()) {
+    close_channel(ch);
+    return;
+  }
+  if (ch->session.get_state() == Session::RECEIVER)
+    deliver(ch); // there may be more waiting now that the socket drained
+  if (!ch->closed)
+    update_events(ch);
+}
+
+// move pending deliveries from the receiver's queue to its socket
+void EventLoop::deliver(Channel *ch) {
+  ch->session.deliver_queued(OUTPUT_HIGH_WATER);
+  if (ch->session.is_done())
+    close_channel(ch);
+  else
+    update_events(ch);
+}
+
+// Only ask for writability while there is output waiting for the
+// socket, and stop reading while more than OUTPUT_HIGH_WATER of it is:
+// a client pipelining requests without reading the replies is left to
+// fill the socket's buffers rather than ours. Reading resumes once the
+// output drains below the mark.
+void EventLoop::update_events(Channel *ch) {
+  uint32_t events = 0;
+  if (ch->conn.pending_output() < OUTPUT_HIGH_WATER)
+    events |= EPOLLIN | EPOLLRDHUP;
+  if (ch->conn.has_pending_output())
+    events |= EPOLLOUT;
+  if (events == ch->sock.events)
+    return;
+  ch->sock.events = events;
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = &ch->sock;
+  epoll_ctl(m_epfd, EPOLL_CTL_MOD, ch->conn.get_fd(), &ev);
+}
+
+void EventLoop::close_channel(Channel *ch) {
+  if (ch->closed)
+    return;
+  ch->closed = true;
+  epoll_ctl(m_epfd, EPOLL_CTL_DEL, ch->conn.get_fd(), nullptr);
+  if (ch->queue_registered)
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, ch->session.get_user()->mqueue.get_fd(), nullptr);
+  m_closed.push_back(ch);
+}
+
+void EventLoop::reap_closed() {
+  for (Channel *ch : m_closed) {
+    delete ch; // the session leaves its room as it is destroyed
+    m_server->connection_closed();
+  }
+  m_closed.clear();
+}
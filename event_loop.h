@@ -0,0 +1,55 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <vector>
+#include <pthread.h>
+
+class Server;
+struct Channel;
+
+// An EventLoop is a thread that multiplexes many non-blocking client
+// connections over one epoll instance. Each connection is driven by
+// a Session, so the protocol is the same as in the thread-per-client
+// mode. A receiver's queue eventfd is registered alongside its socket,
+// so deliveries wake the loop directly.
+class EventLoop {
+public:
+  EventLoop(Server *server);
+  ~EventLoop();
+
+  // create the epoll instance and start the loop thread
+  bool start();
+
+  // Hand an accepted socket to this loop. Safe to call from any thread.
+  void add_connection(int fd);
+
+private:
+  // prohibit value semantics
+  EventLoop(const EventLoop &);
+  EventLoop &operator=(const EventLoop &);
+
+  static void *run(void *arg);
+  void loop();
+  void wake();
+  void accept_incoming();
+  void handle_input(Channel *ch);
+  void handle_output(Channel *ch);
+  void deliver(Channel *ch);
+  void update_events(Channel *ch);
+  void close_channel(Channel *ch);
+  void reap_closed();
+
+  Server *m_server;
+  int m_epfd;
+  int m_wakefd; // eventfd used to wake the loop from other threads
+  pthread_t m_thread;
+
+  pthread_mutex_t m_lock; // protects m_incoming
+  std::vector<int> m_incoming;
+
+  // channels closed during the current iteration, deleted at its end
+  // so that later events in the same batch never see a freed Channel
+  std::vector<Channel *> m_closed;
+};
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,214 @@
+// Fan-out benchmark: how many system calls the server makes per
+// delivered message when one sender broadcasts into a large room. It
+// starts the server itself, once in the mode given on the command
+// line, with libsyscount.so preloaded to count the server's I/O system
+// calls (see syscount.c), connects the receivers and a sender, and
+// sends the messages pipelined while reading everything back.
+// "make bench-fanout" compares the epoll and io_uring modes.
+//
+// Usage: fanout_bench <mode> [receivers] [messages] [server threads]
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::cerr;
+using std::string;
+
+namespace {
+  // the counter the preloaded library in the server adds to
+  volatile uint64_t *syscalls;
+
+  uint64_t read_counter() {
+    return __atomic_load_n(syscalls, __ATOMIC_RELAXED);
+  }
+
+  // a port nobody is listening on right now
+  int free_port() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    getsockname(fd, (struct sockaddr *) &addr, &len);
+    close(fd);
+    return ntohs(addr.sin_port);
+  }
+
+  pid_t start_server(const char *mode, int port, const char *threads, const char *count_file) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      setenv("LD_PRELOAD", "./libsyscount.so", 1);
+      setenv("SYSCOUNT_FILE", count_file, 1);
+      string port_arg = std::to_string(port);
+      // unbounded queues, so every receiver gets every message
+      execl("./server", "server", "-m", mode, "-t", threads, "-q", "0",
+            port_arg.c_str(), (char *) nullptr);
+      perror("exec ./server");
+      _exit(1);
+    }
+    return pid;
+  }
+
+  int connect_to(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    for (int attempt = 0; attempt < 200; attempt++) { // the server may still be starting
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+        return fd;
+      close(fd);
+      usleep(10000);
+    }
+    return -1;
+  }
+
+  void write_all(int fd, const string &s) {
+    size_t done = 0;
+    while (done < s.size()) {
+      ssize_t n = write(fd, s.data() + done, s.size() - done);
+      if (n <= 0) {
+        perror("write");
+        exit(1);
+      }
+      done += n;
+    }
+  }
+
+  // read until lines lines have arrived
+  void read_lines(int fd, int lines) {
+    char buf[4096];
+    while (lines > 0) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n <= 0) {
+        cerr << "connection closed during setup\n";
+        exit(1);
+      }
+      for (ssize_t i = 0; i < n; i++)
+        lines -= (buf[i] == '\n');
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    cerr << "Usage: fanout_bench <mode> [receivers] [messages] [server threads]\n";
+    return 1;
+  }
+  const char *mode = argv[1];
+  int num_receivers = (argc > 2) ? atoi(argv[2]) : 1000;
+  int num_messages = (argc > 3) ? atoi(argv[3]) : 1000;
+  const char *threads = (argc > 4) ? argv[4] : "4";
+
+  char count_file[] = "/tmp/fanout_bench.XXXXXX";
+  int cfd = mkstemp(count_file);
+  if (cfd < 0 || ftruncate(cfd, sizeof(uint64_t)) < 0) {
+    perror(count_file);
+    return 1;
+  }
+  void *p = mmap(nullptr, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, cfd, 0);
+  close(cfd);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  syscalls = static_cast<volatile uint64_t *>(p);
+
+  int port = free_port();
+  pid_t server = start_server(mode, port, threads, count_file);
+
+  std::vector<int> receivers;
+  for (int i = 0; i < num_receivers; i++) {
+    int fd = connect_to(port);
+    if (fd < 0) {
+      cerr << "can't connect to the server\n";
+      kill(server, SIGKILL);
+      return 1;
+    }
+    write_all(fd, "rlogin:r" + std::to_string(i) + "\njoin:fanout\n");
+    receivers.push_back(fd);
+  }
+  for (int fd : receivers)
+    read_lines(fd, 2);
+  int sender = connect_to(port);
+  write_all(sender, "slogin:s\njoin:fanout\n");
+  read_lines(sender, 2);
+
+  // every request is written up front; the replies are read as they come
+  string requests;
+  for (int i = 0; i < num_messages; i++)
+    requests += "sendall:message " + std::to_string(i) + " of the fan-out benchmark\n";
+  fcntl(sender, F_SETFL, O_NONBLOCK);
+
+  uint64_t before = read_counter();
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<struct pollfd> fds(num_receivers + 1);
+  for (int i = 0; i < num_receivers; i++)
+    fds[i].fd = receivers[i];
+  fds[num_receivers].fd = sender;
+  size_t written = 0;
+  long expected = (long) num_messages * (num_receivers + 1); // deliveries and replies
+  long received = 0;
+  char buf[65536];
+  while (received < expected) {
+    for (int i = 0; i <= num_receivers; i++)
+      fds[i].events = POLLIN;
+    if (written < requests.size())
+      fds[num_receivers].events |= POLLOUT;
+    if (poll(fds.data(), fds.size(), 5000) <= 0) {
+      cerr << "timed out with " << received << " of " << expected << " lines\n";
+      break;
+    }
+    for (int i = 0; i <= num_receivers; i++) {
+      if (fds[i].revents & POLLOUT) {
+        ssize_t n = write(sender, requests.data() + written, requests.size() - written);
+        if (n > 0)
+          written += n;
+      }
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+        if (n <= 0) {
+          cerr << "connection closed by the server\n";
+          expected = received;
+          break;
+        }
+        for (ssize_t j = 0; j < n; j++)
+          received += (buf[j] == '\n');
+      }
+    }
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  uint64_t calls = read_counter() - before;
+  long deliveries = received - num_messages;
+  double secs = std::chrono::duration<double>(end - start).count();
+  cout << mode << "\t" << num_receivers << "\t" << num_messages << "\t" << deliveries
+       << "\t" << secs << "\t" << (long) (deliveries / secs) << "\t" << calls
+       << "\t" << (double) calls / deliveries << "\n";
+
+  kill(server, SIGKILL);
+  waitpid(server, nullptr, 0);
+  unlink(count_file);
+  return 0;
+}
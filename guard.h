@@ -20,4 +20,39 @@ private:
   pthread_mutex_t &lock;
 };
 
+// Guards holding a reader/writer lock in shared or exclusive mode
+class ReadGuard {
+public:
+  ReadGuard(pthread_rwlock_t &lock)
+    : lock(lock) {
+    pthread_rwlock_rdlock(&lock);
+  }
+
+  ~ReadGuard() {
+    pthread_rwlock_unlock(&lock);
+  }
+
+private:
+  ReadGuard(const ReadGuard &);
+  ReadGuard &operator=(const ReadGuard &);
+  pthread_rwlock_t &lock;
+};
+
+class WriteGuard {
+public:
+  WriteGuard(pthread_rwlock_t &lock)
+    : lock(lock) {
+    pthread_rwlock_wrlock(&lock);
+  }
+
+  ~WriteGuard() {
+    pthread_rwlock_unlock(&lock);
+  }
+
+private:
+  WriteGuard(const WriteGuard &);
+  WriteGuard &operator=(const WriteGuard &);
+  pthread_rwlock_t &lock;
+};
+
 #endif // GUARD_H
@@ -0,0 +1,538 @@
+// Load generator: end-to-end delivery latency and throughput under a
+// steady message rate. It starts the server itself, connects senders
+// and receivers spread over a number of rooms, and has the senders
+// broadcast at the requested total rate, each message carrying the time
+// it was due to be sent. Receivers note how long each delivery took to
+// arrive, so a server that falls behind shows up as growing latency
+// rather than as a quietly lower rate. At the end it reports the
+// latency percentiles, messages and deliveries per second, and the
+// server's CPU time and memory, read from /proc.
+// "make bench" runs it; use BENCH_ARGS to pass options, e.g.
+// make bench BENCH_ARGS="-m coro -r 2000 -n 50000".
+//
+// Usage: load_bench [options] [-- server options]
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::cerr;
+using std::string;
+
+namespace {
+  struct Options {
+    const char *mode = "threads";
+    const char *threads = "4";
+    int senders = 16;
+    int receivers = 64;
+    int rooms = 8;
+    double rate = 10000;  // messages per second from all senders, 0 for flat out
+    double seconds = 5;   // measured
+    double warmup = 1;    // run before measuring
+    size_t payload = 64;  // bytes of message text
+    int window = 64;      // requests a sender may have unanswered
+    std::vector<const char *> server_args;
+  };
+
+  void usage() {
+    cerr << "Usage: load_bench [options] [-- server options]\n"
+         << "  -m <mode>     server mode (default threads)\n"
+         << "  -t <n>        server event loop threads (default 4)\n"
+         << "  -s <n>        senders (default 16)\n"
+         << "  -r <n>        receivers (default 64)\n"
+         << "  -R <n>        rooms (default 8)\n"
+         << "  -n <rate>     messages per second from all senders, 0 for as fast as\n"
+         << "                the server takes them (default 10000)\n"
+         << "  -d <secs>     how long to measure (default 5)\n"
+         << "  -W <secs>     warm-up before measuring (default 1)\n"
+         << "  -b <bytes>    message size (default 64)\n"
+         << "  -w <n>        unanswered requests per sender (default 64)\n";
+  }
+
+  int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // Latencies, counted in buckets that are 1/64 of a power of two wide,
+  // so percentiles come out within about 1.5% without keeping every
+  // sample.
+  class Histogram {
+  public:
+    static const int SUB_BITS = 6;
+
+    Histogram() : m_buckets(64 << SUB_BITS, 0), m_count(0), m_max(0) { }
+
+    void record(int64_t ns) {
+      uint64_t v = ns < 0 ? 0 : (uint64_t) ns;
+      m_buckets[bucket(v)]++;
+      m_count++;
+      if (v > m_max)
+        m_max = v;
+    }
+
+    uint64_t count() const { return m_count; }
+    uint64_t max() const { return m_max; }
+
+    // the smallest value that at least fraction of the samples don't exceed
+    uint64_t percentile(double fraction) const {
+      uint64_t want = (uint64_t) std::ceil(fraction * m_count), seen = 0;
+      for (size_t i = 0; i < m_buckets.size(); i++) {
+        seen += m_buckets[i];
+        if (seen >= want && seen > 0)
+          return std::min(upper(i), m_max);
+      }
+      return m_max;
+    }
+
+  private:
+    static size_t bucket(uint64_t v) {
+      if (v < (1u << SUB_BITS))
+        return v;
+      int exp = 63 - __builtin_clzll(v) - SUB_BITS; // bits below the sub-bucket
+      return ((size_t) (exp + 1) << SUB_BITS) + ((v >> exp) & ((1u << SUB_BITS) - 1));
+    }
+
+    // the largest value in bucket i
+    static uint64_t upper(size_t i) {
+      if (i < (1u << SUB_BITS))
+        return i;
+      int exp = (int) (i >> SUB_BITS) - 1;
+      uint64_t mantissa = (i & ((1u << SUB_BITS) - 1)) | (1u << SUB_BITS);
+      return ((mantissa + 1) << exp) - 1;
+    }
+
+    std::vector<uint64_t> m_buckets;
+    uint64_t m_count;
+    uint64_t m_max;
+  };
+
+  // a client connection, with what has yet to be written and the
+  // start of a line that hasn't fully arrived
+  struct Client {
+    int fd;
+    bool sender;
+    int room;
+    string out;
+    size_t out_pos = 0;
+    string partial;
+    int outstanding = 0; // a sender's unanswered requests
+    bool want_write = false;
+  };
+
+  // a port nobody is listening on right now
+  int free_port() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    getsockname(fd, (struct sockaddr *) &addr, &len);
+    close(fd);
+    return ntohs(addr.sin_port);
+  }
+
+  pid_t start_server(const Options &opts, int port) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      string port_arg = std::to_string(port);
+      std::vector<const char *> args = { "server", "-m", opts.mode, "-t", opts.threads };
+      args.insert(args.end(), opts.server_args.begin(), opts.server_args.end());
+      args.push_back(port_arg.c_str());
+      args.push_back(nullptr);
+      execv("./server", const_cast<char **>(args.data()));
+      perror("exec ./server");
+      _exit(1);
+    }
+    return pid;
+  }
+
+  int connect_to(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    for (int attempt = 0; attempt < 200; attempt++) { // the server may still be starting
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return fd;
+      }
+      close(fd);
+      usleep(10000);
+    }
+    return -1;
+  }
+
+  // read one reply line during setup, when the connection still blocks
+  bool read_line(int fd, string &line) {
+    line.clear();
+    char c;
+    while (read(fd, &c, 1) == 1) {
+      if (c == '\n')
+        return true;
+      line += c;
+    }
+    return false;
+  }
+
+  bool setup(int fd, const string &requests, int replies) {
+    if (write(fd, requests.data(), requests.size()) != (ssize_t) requests.size())
+      return false;
+    string line;
+    for (int i = 0; i < replies; i++)
+      if (!read_line(fd, line) || line.compare(0, 3, "ok:") != 0) {
+        cerr << "setup failed: " << line << "\n";
+        return false;
+      }
+    return true;
+  }
+
+  // the server's CPU time in seconds, from /proc/<pid>/stat
+  double cpu_seconds(pid_t pid) {
+    std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+    string stat;
+    std::getline(in, stat);
+    // fields after the command name, which is in parentheses
+    std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+    string field;
+    unsigned long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; i++) {
+      if (i == 14)
+        utime = std::stoul(field);
+      else if (i == 15)
+        stime = std::stoul(field);
+    }
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+  }
+
+  // a "VmRSS:"-style line of /proc/<pid>/status, in kB
+  long status_kb(pid_t pid, const char *key) {
+    std::ifstream in("/proc/" + std::to_string(pid) + "/status");
+    string line;
+    size_t key_len = strlen(key);
+    while (std::getline(in, line))
+      if (line.compare(0, key_len, key) == 0)
+        return atol(line.c_str() + key_len);
+    return -1;
+  }
+
+  class LoadGenerator {
+  public:
+    LoadGenerator(const Options &opts) : m_opts(opts), m_epfd(epoll_create1(0)) { }
+
+    bool connect_clients(int port) {
+      // receivers first, so every message has all its recipients
+      for (int i = 0; i < m_opts.receivers; i++)
+        if (!add_client(port, false, i))
+          return false;
+      for (int i = 0; i < m_opts.senders; i++)
+        if (!add_client(port, true, i))
+          return false;
+      return true;
+    }
+
+    void run(pid_t server);
+
+  private:
+    bool add_client(int port, bool sender, int i) {
+      int fd = connect_to(port);
+      if (fd < 0) {
+        cerr << "can't connect to the server\n";
+        return false;
+      }
+      Client c;
+      c.fd = fd;
+      c.sender = sender;
+      c.room = i % m_opts.rooms;
+      string login = (sender ? "slogin:s" : "rlogin:r") + std::to_string(i) + "\n";
+      if (!setup(fd, login + "join:room" + std::to_string(c.room) + "\n", 2))
+        return false;
+      fcntl(fd, F_SETFL, O_NONBLOCK);
+      m_clients.push_back(c);
+      m_room_receivers.resize(m_opts.rooms);
+      if (!sender)
+        m_room_receivers[c.room]++;
+      return true;
+    }
+
+    void register_all() {
+      for (size_t i = 0; i < m_clients.size(); i++) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_clients[i].fd, &ev);
+      }
+    }
+
+    void send_message(Client &c, int64_t stamp) {
+      string line = "sendall:" + std::to_string(stamp) + " ";
+      if (line.size() < m_opts.payload + 8)
+        line.append(m_opts.payload + 8 - line.size(), 'x');
+      line += '\n';
+      c.out += line;
+      c.outstanding++;
+      m_sent++;
+      m_expected += m_room_receivers[c.room];
+      flush(c);
+    }
+
+    void flush(Client &c) {
+      while (c.out_pos < c.out.size()) {
+        ssize_t n = write(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos);
+        if (n < 0) {
+          if (errno != EAGAIN)
+            m_failed = true;
+          break;
+        }
+        c.out_pos += n;
+      }
+      if (c.out_pos == c.out.size()) {
+        c.out.clear();
+        c.out_pos = 0;
+      }
+      bool want_write = !c.out.empty();
+      if (want_write != c.want_write) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+        ev.data.u64 = &c - m_clients.data();
+        epoll_ctl(m_epfd, EPOLL_CTL_MOD, c.fd, &ev);
+        c.want_write = want_write;
+      }
+    }
+
+    void handle_input(Client &c) {
+      char buf[65536];
+      while (true) {
+        ssize_t n = read(c.fd, buf, sizeof(buf));
+        if (n == 0 || (n < 0 && errno != EAGAIN)) {
+          cerr << "connection closed by the server\n";
+          m_failed = true;
+          return;
+        }
+        if (n < 0)
+          return;
+        int64_t now = now_ns();
+        size_t start = 0;
+        for (ssize_t i = 0; i < n; i++) {
+          if (buf[i] != '\n')
+            continue;
+          if (c.partial.empty()) {
+            handle_line(c, buf + start, i - start, now);
+          } else {
+            c.partial.append(buf + start, i - start);
+            handle_line(c, c.partial.data(), c.partial.size(), now);
+            c.partial.clear();
+          }
+          start = i + 1;
+        }
+        c.partial.append(buf + start, n - start);
+      }
+    }
+
+    void handle_line(Client &c, const char *line, size_t len, int64_t now) {
+      if (c.sender) {
+        if (len >= 4 && memcmp(line, "err:", 4) == 0)
+          m_errors++;
+        c.outstanding--;
+        return;
+      }
+      // "delivery:room:sender:stamp ..."
+      const char *p = line;
+      const char *end = line + len;
+      for (int colons = 0; colons < 3 && p < end; p++)
+        colons += (*p == ':');
+      m_received++;
+      // the latency of every message due during the measurement counts,
+      // however late it arrives
+      int64_t stamp = atoll(p);
+      if (stamp >= m_measure_start && stamp < m_measure_end)
+        m_latency.record(now - stamp);
+    }
+
+    const Options &m_opts;
+    int m_epfd;
+    std::vector<Client> m_clients;
+    std::vector<int> m_room_receivers; // receivers in each room
+    Histogram m_latency;
+    int64_t m_measure_start = 0, m_measure_end = 0;
+    bool m_failed = false;
+    long m_sent = 0, m_expected = 0, m_received = 0, m_errors = 0;
+  };
+
+  void LoadGenerator::run(pid_t server) {
+    register_all();
+    std::vector<size_t> senders;
+    for (size_t i = 0; i < m_clients.size(); i++)
+      if (m_clients[i].sender)
+        senders.push_back(i);
+
+    int64_t start = now_ns();
+    m_measure_start = start + (int64_t) (m_opts.warmup * 1e9);
+    m_measure_end = m_measure_start + (int64_t) (m_opts.seconds * 1e9);
+    bool measuring = false;
+    double cpu_start = 0;
+    long sent_start = 0, received_start = 0;
+    size_t next_sender = 0;
+    long scheduled = 0; // messages due so far
+    struct epoll_event events[256];
+
+    while (!m_failed) {
+      int64_t now = now_ns();
+      if (!measuring && now >= m_measure_start) {
+        measuring = true;
+        cpu_start = cpu_seconds(server);
+        sent_start = m_sent;
+        received_start = m_received;
+      }
+      if (now >= m_measure_end)
+        break;
+
+      // Send what is due, each message stamped with the time it was due,
+      // so a sender held up by a full window doesn't hide the delay.
+      // At rate 0 every sender just keeps its window full.
+      if (m_opts.rate > 0)
+        scheduled = (long) ((now - start) * 1e-9 * m_opts.rate);
+      for (size_t tried = 0; tried < senders.size(); ) {
+        if (m_opts.rate > 0 && m_sent >= scheduled)
+          break;
+        Client &c = m_clients[senders[next_sender]];
+        next_sender = (next_sender + 1) % senders.size();
+        if (c.outstanding >= m_opts.window) {
+          tried++;
+          continue;
+        }
+        tried = 0;
+        int64_t due = (m_opts.rate > 0) ? start + (int64_t) (m_sent * 1e9 / m_opts.rate) : now;
+        send_message(c, due);
+      }
+
+      // wait for input, or until the next message is due (the
+      // millisecond timeout of epoll_wait would bunch them up)
+      int64_t wait = 1000000;
+      if (m_opts.rate > 0 && m_sent >= scheduled) {
+        int64_t next_due = start + (int64_t) (m_sent * 1e9 / m_opts.rate) + 1;
+        wait = std::max<int64_t>(0, std::min(wait, next_due - now_ns()));
+      }
+      struct timespec timeout = { 0, (long) wait };
+      int n = epoll_pwait2(m_epfd, events, 256, &timeout, nullptr);
+      for (int i = 0; i < n; i++) {
+        Client &c = m_clients[events[i].data.u64];
+        if (events[i].events & EPOLLOUT)
+          flush(c);
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          handle_input(c);
+      }
+    }
+
+    double cpu = cpu_seconds(server) - cpu_start;
+    double secs = (now_ns() - m_measure_start) * 1e-9;
+    long sent = m_sent - sent_start;
+    long delivered = m_received - received_start;
+
+    // let what is still on its way arrive, to see whether any was lost
+    int64_t drain_until = now_ns() + 5000000000LL;
+    while (!m_failed && m_received < m_expected && now_ns() < drain_until) {
+      int n = epoll_wait(m_epfd, events, 256, 100);
+      for (int i = 0; i < n; i++) {
+        Client &c = m_clients[events[i].data.u64];
+        if (events[i].events & EPOLLOUT)
+          flush(c);
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          handle_input(c);
+      }
+    }
+
+    printf("mode %s: %d senders, %d receivers, %d rooms, %zu-byte messages, ",
+           m_opts.mode, m_opts.senders, m_opts.receivers, m_opts.rooms, m_opts.payload);
+    if (m_opts.rate > 0)
+      printf("%.0f msgs/s offered\n", m_opts.rate);
+    else
+      printf("unthrottled (window %d)\n", m_opts.window);
+    printf("throughput: %.0f msgs/s sent, %.0f deliveries/s over %.1f s\n",
+           sent / secs, delivered / secs, secs);
+    printf("latency (us): p50 %.1f  p99 %.1f  p999 %.1f  max %.1f  (%llu samples)\n",
+           m_latency.percentile(0.5) / 1e3, m_latency.percentile(0.99) / 1e3,
+           m_latency.percentile(0.999) / 1e3, m_latency.max() / 1e3,
+           (unsigned long long) m_latency.count());
+    printf("server: %.2f CPU seconds (%.0f%% of a core), RSS %ld kB, peak %ld kB\n",
+           cpu, 100 * cpu / secs, status_kb(server, "VmRSS:"), status_kb(server, "VmHWM:"));
+    if (m_received < m_expected || m_errors > 0)
+      printf("lost: %ld of %ld deliveries, %ld error replies\n",
+             m_expected - m_received, m_expected, m_errors);
+  }
+}
+
+int main(int argc, char **argv) {
+  Options opts;
+  int i = 1;
+  for (; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--") {
+      for (i++; i < argc; i++)
+        opts.server_args.push_back(argv[i]);
+      break;
+    }
+    if (arg.size() != 2 || arg[0] != '-' || i + 1 == argc) {
+      usage();
+      return 1;
+    }
+    const char *val = argv[++i];
+    switch (arg[1]) {
+    case 'm': opts.mode = val; break;
+    case 't': opts.threads = val; break;
+    case 's': opts.senders = atoi(val); break;
+    case 'r': opts.receivers = atoi(val); break;
+    case 'R': opts.rooms = atoi(val); break;
+    case 'n': opts.rate = atof(val); break;
+    case 'd': opts.seconds = atof(val); break;
+    case 'W': opts.warmup = atof(val); break;
+    case 'b': opts.payload = atoi(val); break;
+    case 'w': opts.window = atoi(val); break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (opts.senders < 1 || opts.receivers < 0 || opts.rooms < 1 || opts.window < 1) {
+    usage();
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  int port = free_port();
+  pid_t server = start_server(opts, port);
+  LoadGenerator generator(opts);
+  int status = 1;
+  if (generator.connect_clients(port)) {
+    generator.run(server);
+    status = 0;
+  }
+  kill(server, SIGKILL);
+  waitpid(server, nullptr, 0);
+  return status;
+}
@@ -0,0 +1,60 @@
+#include <cstring>
+#include "message.h"
+
+namespace {
+  // tag strings indexed by TagCode
+  const char *const TAG_NAMES[TAGC_LIMIT] = {
+    nullptr,
+    TAG_ERR,
+    TAG_OK,
+    TAG_SLOGIN,
+    TAG_RLOGIN,
+    TAG_JOIN,
+    TAG_LEAVE,
+    TAG_SENDALL,
+    TAG_SENDUSER,
+    TAG_QUIT,
+    TAG_DELIVERY,
+    TAG_EMPTY,
+    TAG_POLL,
+  };
+}
+
+int tag_code(const char *tag, size_t len) {
+  for (int code = 1; code < TAGC_LIMIT; code++) {
+    const char *name = TAG_NAMES[code];
+    if (strncmp(name, tag, len) == 0 && name[len] == '\0')
+      return code;
+  }
+  return 0;
+}
+
+const char *tag_name(unsigned code) {
+  return (code > 0 && code < TAGC_LIMIT) ? TAG_NAMES[code] : nullptr;
+}
+
+Frame::Frame(const char *tag, const std::string &data) {
+  build(tag, nullptr, 0, data.data(), data.size());
+}
+
+Frame::Frame(const char *tag, const std::string &data_prefix, const std::string &data) {
+  build(tag, data_prefix.data(), data_prefix.size(), data.data(), data.size());
+}
+
+void Frame::build(const char *tag, const char *prefix, size_t prefix_len, const char *data, size_t data_len) {
+  size_t tag_len = strlen(tag);
+  size_t total_len = prefix_len + data_len; // of the frame's data
+  m_size = tag_len + total_len + 2;
+  m_bytes = (m_size <= INLINE_LEN) ? m_inline : new char[m_size];
+  memcpy(m_bytes, tag, tag_len);
+  m_bytes[tag_len] = ':';
+  data_offset = tag_len + 1;
+  if (prefix_len > 0) // (memcpy mustn't see the null pointer)
+    memcpy(m_bytes + data_offset, prefix, prefix_len);
+  memcpy(m_bytes + data_offset + prefix_len, data, data_len);
+  m_bytes[m_size - 1] = '\n';
+  header_len = encode_varint(total_len + 1, header);
+  header[header_len++] = (unsigned char) tag_code(tag, tag_len);
+  fits_line = m_size <= Message::MAX_LEN
+    && memchr(m_bytes + data_offset, '\n', total_len) == nullptr;
+}
@@ -3,6 +3,59 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// A message's tag, kept inside the Message itself: no tag is longer
+// than MAX_LEN characters, so a tag never needs the heap. A longer
+// string (which only a misbehaving client can send) becomes an invalid
+// tag that is empty and equal to no tag, not even an empty one.
+class Tag {
+public:
+  static const unsigned MAX_LEN = 8;
+
+  Tag() : m_len(0) { m_chars[0] = '\0'; }
+  Tag(const char *s) { assign(s); }
+  Tag(const std::string &s) { assign(s.data(), s.size()); }
+
+  Tag &operator=(const char *s) { assign(s); return *this; }
+
+  void assign(const char *s, size_t len) {
+    if (len > MAX_LEN) {
+      m_len = INVALID;
+      m_chars[0] = '\0';
+      return;
+    }
+    memcpy(m_chars, s, len);
+    m_chars[len] = '\0';
+    m_len = (unsigned char) len;
+  }
+  void assign(const char *s) { assign(s, strlen(s)); }
+
+  void swap(Tag &other) {
+    Tag tmp = *this;
+    *this = other;
+    other = tmp;
+  }
+
+  const char *data() const { return m_chars; }
+  const char *c_str() const { return m_chars; }
+  size_t size() const { return m_len == INVALID ? 0 : m_len; }
+  bool is_valid() const { return m_len != INVALID; }
+
+  bool operator==(const char *s) const {
+    return m_len != INVALID && strncmp(m_chars, s, MAX_LEN + 1) == 0;
+  }
+  bool operator!=(const char *s) const { return !(*this == s); }
+
+private:
+  static const unsigned char INVALID = 0xff;
+
+  char m_chars[MAX_LEN + 1]; // NUL-terminated
+  unsigned char m_len;
+};
 
 struct Message {
   // An encoded message may have at most this many characters,
@@ -11,19 +64,107 @@ struct Message {
   // temporarily store the encoded message.)
   static const unsigned MAX_LEN = 255;
 
-  std::string tag;
+  Tag tag;
   std::string data;
 
   Message() { }
 
-  Message(const std::string &tag, const std::string &data)
+  Message(const Tag &tag, const std::string &data)
     : tag(tag), data(data) { }
 
   // TODO: you could add helper functions
 };
 
-// standard message tags (note that you don't need to worry about
-// "senduser" or "empty" messages)
+// Protocol version 2 frames each message in binary instead of as a
+// "tag:data\n" line: a varint (7 bits per byte, least significant
+// first, high bit set on all but the last byte) giving the number of
+// bytes that follow, then one byte holding the tag's code, then the
+// data. Nothing needs to be scanned to find where a message ends, and
+// the data may contain any bytes, including newlines and colons.
+// A client asks for version 2 by sending "proto:2" as its first line;
+// once the server has replied "ok" both directions use frames.
+enum TagCode {
+  TAGC_ERR = 1,
+  TAGC_OK,
+  TAGC_SLOGIN,
+  TAGC_RLOGIN,
+  TAGC_JOIN,
+  TAGC_LEAVE,
+  TAGC_SENDALL,
+  TAGC_SENDUSER,
+  TAGC_QUIT,
+  TAGC_DELIVERY,
+  TAGC_EMPTY,
+  TAGC_POLL,
+  TAGC_LIMIT, // one past the last code
+};
+
+// a varint never needs more than this many bytes for a 32-bit length
+static const unsigned MAX_VARINT_LEN = 5;
+
+// returns the code for a tag string, or 0 if it has none
+int tag_code(const char *tag, size_t len);
+
+// returns the tag string for a code, or nullptr if code is not a TagCode
+const char *tag_name(unsigned code);
+
+// writes value as a varint to out, returning the number of bytes used
+inline unsigned encode_varint(uint32_t value, unsigned char *out) {
+  unsigned n = 0;
+  while (value >= 0x80) {
+    out[n++] = (unsigned char) (value | 0x80);
+    value >>= 7;
+  }
+  out[n++] = (unsigned char) value;
+  return n;
+}
+
+// A message already encoded in its wire format. A broadcast encodes
+// its delivery into one Frame and every member's queue shares it, so
+// a Frame must never change once it is built. The version 1 line is
+// kept whole; a version 2 frame is the header followed by the data
+// part of that line, so both are built without copying the data twice.
+struct Frame {
+  // a frame short enough for a version 1 line keeps its bytes in the
+  // Frame itself, so a pooled Frame needs no other allocation
+  static const unsigned INLINE_LEN = Message::MAX_LEN;
+
+  size_t data_offset; // where data starts in bytes()
+  unsigned char header[MAX_VARINT_LEN + 1]; // version 2 length and tag code
+  unsigned header_len;
+  // false if the data is too long for a line or contains a newline,
+  // either of which a version 2 sender can cause
+  bool fits_line;
+
+  Frame(const char *tag, const std::string &data);
+  // the data is data_prefix followed by data (see Room::broadcast_message)
+  Frame(const char *tag, const std::string &data_prefix, const std::string &data);
+  ~Frame() {
+    if (m_bytes != m_inline)
+      delete[] m_bytes;
+  }
+
+  const char *bytes() const { return m_bytes; } // "tag:data\n"
+  size_t size() const { return m_size; }
+
+  const char *data() const { return m_bytes + data_offset; }
+  size_t data_size() const { return m_size - data_offset - 1; }
+
+private:
+  // prohibit value semantics
+  Frame(const Frame &);
+  Frame &operator=(const Frame &);
+
+  void build(const char *tag, const char *prefix, size_t prefix_len, const char *data, size_t data_len);
+
+  char *m_bytes; // m_inline or a heap array
+  size_t m_size;
+  char m_inline[INLINE_LEN];
+};
+
+typedef std::shared_ptr<const Frame> FramePtr;
+
+// standard message tags
 #define TAG_ERR       "err"       // protocol error
 #define TAG_OK        "ok"        // success response
 #define TAG_SLOGIN    "slogin"    // register as specific user for sending
@@ -31,9 +172,11 @@ struct Message {
 #define TAG_JOIN      "join"      // join a chat room
 #define TAG_LEAVE     "leave"     // leave a chat room
 #define TAG_SENDALL   "sendall"   // send message to all users in chat room
-#define TAG_SENDUSER  "senduser"  // send message to specific user in chat room
+#define TAG_SENDUSER  "senduser"  // send "recipient:text" to a user's receivers
 #define TAG_QUIT      "quit"      // quit
 #define TAG_DELIVERY  "delivery"  // message delivered by server to receiving client
 #define TAG_EMPTY     "empty"     // sent by server to receiving client to indicate no msgs available
+#define TAG_POLL      "poll"      // a receiver asks for up to N queued deliveries
+#define TAG_PROTO     "proto"     // switch to another protocol version (text only)
 
 #endif // MESSAGE_H
@@ -0,0 +1,497 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <iostream>
+#include <memory>
+#include <algorithm>
+#include "guard.h"
+#include "room_history.h"
+#include "message_log.h"
+
+using std::cerr;
+using std::string;
+
+namespace {
+  // what precedes each delivery's data in a segment
+  struct RecordHeader {
+    uint32_t length;   // of the data
+    uint32_t checksum; // of the sequence number and the data
+    uint64_t seq;
+  };
+
+  // FNV-1a, which is plenty for telling a torn write from a whole one
+  uint32_t checksum(uint64_t seq, const char *data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 8; i++)
+      hash = (hash ^ (unsigned char) (seq >> (8 * i))) * 16777619u;
+    for (size_t i = 0; i < size; i++)
+      hash = (hash ^ (unsigned char) data[i]) * 16777619u;
+    return hash;
+  }
+
+  // Room names may contain anything but a colon, so in file names every
+  // byte other than a letter, digit, '-' or '_' is written as %XX.
+  string encode_name(const string &name) {
+    string encoded;
+    for (unsigned char c : name) {
+      if (isalnum(c) || c == '-' || c == '_') {
+        encoded += (char) c;
+      } else {
+        char hex[4];
+        snprintf(hex, sizeof(hex), "%%%02X", c);
+        encoded += hex;
+      }
+    }
+    return encoded;
+  }
+
+  bool decode_name(const string &encoded, string &name) {
+    name.clear();
+    for (size_t i = 0; i < encoded.size(); i++) {
+      if (encoded[i] != '%') {
+        name += encoded[i];
+        continue;
+      }
+      if (i + 2 >= encoded.size() || !isxdigit(encoded[i + 1]) || !isxdigit(encoded[i + 2]))
+        return false;
+      name += (char) std::stoi(encoded.substr(i + 1, 2), nullptr, 16);
+      i += 2;
+    }
+    return true;
+  }
+
+  // "<room>.<first sequence number>.log"
+  string segment_name(const string &room_name, uint64_t first_seq) {
+    char seq[24];
+    snprintf(seq, sizeof(seq), "%020llu", (unsigned long long) first_seq);
+    return encode_name(room_name) + "." + seq + ".log";
+  }
+
+  bool parse_segment_name(const string &file_name, string &room_name, uint64_t &first_seq) {
+    const string suffix = ".log";
+    if (file_name.size() <= suffix.size()
+        || file_name.compare(file_name.size() - suffix.size(), suffix.size(), suffix) != 0)
+      return false;
+    string stem = file_name.substr(0, file_name.size() - suffix.size());
+    size_t dot = stem.rfind('.');
+    if (dot == string::npos || dot + 1 == stem.size())
+      return false;
+    char *end;
+    first_seq = strtoull(stem.c_str() + dot + 1, &end, 10);
+    return *end == '\0' && decode_name(stem.substr(0, dot), room_name);
+  }
+
+  // a file read-only through mmap, for as long as the Mapping lives
+  class Mapping {
+  public:
+    Mapping(const string &path) : m_data(nullptr), m_size(0) {
+      int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        return;
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+          m_data = static_cast<const char *>(data);
+          m_size = st.st_size;
+          posix_madvise(data, m_size, POSIX_MADV_SEQUENTIAL);
+        }
+      }
+      close(fd);
+    }
+    ~Mapping() {
+      if (m_data != nullptr)
+        munmap((void *) m_data, m_size);
+    }
+
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+  private:
+    Mapping(const Mapping &);
+    Mapping &operator=(const Mapping &);
+
+    const char *m_data;
+    size_t m_size;
+  };
+
+  // make a new or removed file's directory entry durable
+  void sync_dir(const string &dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// RoomLog
+////////////////////////////////////////////////////////////////////////
+
+RoomLog::RoomLog(const string &dir, const string &room_name)
+  : m_dir(dir), m_room_name(room_name)
+  , m_fd(-1), m_segment_size(0), m_unsynced(false), m_next_seq(0), m_opens(0) {
+  pthread_mutex_init(&m_lock, nullptr);
+  pthread_mutex_init(&m_file_lock, nullptr);
+}
+
+RoomLog::~RoomLog() {
+  if (m_fd >= 0)
+    close(m_fd);
+  pthread_mutex_destroy(&m_lock);
+  pthread_mutex_destroy(&m_file_lock);
+}
+
+void RoomLog::append(uint64_t seq, const Frame &frame) {
+  RecordHeader header;
+  header.length = frame.data_size();
+  header.checksum = checksum(seq, frame.data(), frame.data_size());
+  header.seq = seq;
+  Guard guard(m_lock);
+  m_pending.append((const char *) &header, sizeof(header));
+  m_pending.append(frame.data(), frame.data_size());
+}
+
+size_t RoomLog::flush(bool sync) {
+  Guard guard(m_file_lock);
+  size_t written = write_pending();
+  if (sync && m_unsynced && m_fd >= 0) {
+    fdatasync(m_fd);
+    m_unsynced = false;
+  }
+  return written;
+}
+
+// Write the records appended so far to the newest segment, starting a
+// new segment (at a record) whenever the newest is full.
+size_t RoomLog::write_pending() {
+  {
+    Guard guard(m_lock);
+    m_writing.swap(m_pending); // appends go on into the emptied buffer
+  }
+  const char *data = m_writing.data();
+  size_t size = m_writing.size(), start = 0, pos = 0;
+  if (m_fd < 0 && !m_segments.empty() && size > 0) // after a restart, carry on with the newest segment
+    open_segment(m_segments.back().first_seq);
+  while (pos < size) {
+    RecordHeader header;
+    memcpy(&header, data + pos, sizeof(header));
+    size_t record_size = sizeof(header) + header.length;
+    size_t segment_size = m_segment_size + (pos - start);
+    if (m_fd < 0 || (segment_size > 0 && segment_size + record_size > SEGMENT_BYTES)) {
+      write_out(data + start, pos - start);
+      start = pos;
+      if (!open_segment(header.seq)) { // the rest is lost
+        size = pos;
+        break;
+      }
+    }
+    if (header.seq >= m_next_seq)
+      m_next_seq = header.seq + 1;
+    pos += record_size;
+  }
+  write_out(data + start, pos - start);
+  m_writing.clear();
+  return size;
+}
+
+void RoomLog::write_out(const char *data, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = write(m_fd, data + done, size - done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      cerr << "Could not write to the log of room " << m_room_name << ": " << strerror(errno) << "\n";
+      break;
+    }
+    done += n;
+  }
+  m_segment_size += done;
+  if (done > 0)
+    m_unsynced = true;
+}
+
+bool RoomLog::open_segment(uint64_t first_seq) {
+  if (m_fd >= 0) { // the full segment is done with
+    if (m_unsynced)
+      fdatasync(m_fd);
+    close(m_fd);
+    m_fd = -1;
+    m_unsynced = false;
+  }
+  string path = m_dir + "/" + segment_name(m_room_name, first_seq);
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    cerr << "Could not open " << path << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  struct stat st;
+  m_segment_size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+  m_fd = fd;
+  if (m_segments.empty() || m_segments.back().path != path)
+    m_segments.push_back(Segment{ first_seq, path });
+  remove_old_segments();
+  sync_dir(m_dir);
+  return true;
+}
+
+void RoomLog::remove_old_segments() {
+  while (m_segments.size() > KEEP_SEGMENTS) {
+    unlink(m_segments.front().path.c_str());
+    m_segments.erase(m_segments.begin());
+  }
+}
+
+template <typename Fn>
+size_t RoomLog::scan(const char *data, size_t size, Fn fn) {
+  size_t pos = 0;
+  while (size - pos >= sizeof(RecordHeader)) {
+    RecordHeader header;
+    memcpy(&header, data + pos, sizeof(header));
+    if (header.length > size - pos - sizeof(header))
+      break;
+    const char *record = data + pos + sizeof(header);
+    if (checksum(header.seq, record, header.length) != header.checksum)
+      break;
+    fn(header.seq, record, header.length);
+    pos += sizeof(header) + header.length;
+  }
+  return pos;
+}
+
+int64_t RoomLog::recover_segment(const Segment &segment) {
+  int64_t last = -1;
+  size_t intact, size;
+  {
+    Mapping mapping(segment.path);
+    size = mapping.size();
+    intact = scan(mapping.data(), size, [&last](uint64_t seq, const char *, size_t) {
+      if ((int64_t) seq > last)
+        last = seq;
+    });
+  }
+  if (intact < size) {
+    cerr << "Truncating the torn end of " << segment.path << "\n";
+    if (truncate(segment.path.c_str(), intact) != 0)
+      cerr << "Could not truncate " << segment.path << ": " << strerror(errno) << "\n";
+  }
+  return last;
+}
+
+void RoomLog::restore(RoomHistory &history) {
+  Guard guard(m_file_lock);
+  write_pending(); // the segments hold everything appended so far
+  history.resume(m_next_seq);
+  if (history.capacity() == 0)
+    return;
+  uint64_t first = (m_next_seq > history.capacity()) ? m_next_seq - history.capacity() : 0;
+  for (auto &segment : m_segments) {
+    Mapping mapping(segment.path);
+    scan(mapping.data(), mapping.size(), [&history, first](uint64_t seq, const char *data, size_t size) {
+      if (seq >= first)
+        history.restore(seq, std::make_shared<const Frame>(TAG_DELIVERY, string(data, size)));
+    });
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// MessageLog
+////////////////////////////////////////////////////////////////////////
+
+MessageLog::MessageLog(const string &dir, int sync_ms)
+  : m_dir(dir), m_sync_ms(sync_ms), m_stopping(false), m_running(false)
+  , m_bytes_written(0), m_syncs(0) {
+  pthread_mutex_init(&m_lock, nullptr);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&m_stop, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+MessageLog::~MessageLog() {
+  if (m_running) {
+    {
+      Guard guard(m_lock);
+      m_stopping = true;
+      pthread_cond_signal(&m_stop);
+    }
+    pthread_join(m_thread, nullptr);
+  }
+  flush_all(true);
+  for (auto &entry : m_rooms)
+    delete entry.second;
+  pthread_cond_destroy(&m_stop);
+  pthread_mutex_destroy(&m_lock);
+}
+
+bool MessageLog::open() {
+  if (mkdir(m_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    cerr << "Could not create log directory " << m_dir << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  DIR *dir = opendir(m_dir.c_str());
+  if (dir == nullptr) {
+    cerr << "Could not open log directory " << m_dir << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  while (struct dirent *entry = readdir(dir)) {
+    string room_name;
+    uint64_t first_seq;
+    if (!parse_segment_name(entry->d_name, room_name, first_seq))
+      continue;
+    RoomLog *&log = m_rooms[room_name];
+    if (log == nullptr)
+      log = new RoomLog(m_dir, room_name);
+    log->m_segments.push_back(RoomLog::Segment{ first_seq, m_dir + "/" + entry->d_name });
+  }
+  closedir(dir);
+
+  // check every segment, and drop those a crash left without a whole record
+  for (auto &entry : m_rooms) {
+    RoomLog *log = entry.second;
+    std::sort(log->m_segments.begin(), log->m_segments.end(),
+              [](const RoomLog::Segment &a, const RoomLog::Segment &b) { return a.first_seq < b.first_seq; });
+    for (size_t i = 0; i < log->m_segments.size(); ) {
+      int64_t last = log->recover_segment(log->m_segments[i]);
+      if (last < 0) {
+        unlink(log->m_segments[i].path.c_str());
+        log->m_segments.erase(log->m_segments.begin() + i);
+        continue;
+      }
+      if ((uint64_t) last >= log->m_next_seq)
+        log->m_next_seq = last + 1;
+      i++;
+    }
+    log->remove_old_segments();
+  }
+  close_unused(false); // no room has been created yet
+
+  if (pthread_create(&m_thread, nullptr, flusher, this) != 0) {
+    cerr << "Failed to create log flusher thread\n";
+    return false;
+  }
+  m_running = true;
+  return true;
+}
+
+RoomLog *MessageLog::open_room_log(const string &room_name) {
+  Guard guard(m_lock);
+  RoomLog *&log = m_rooms[room_name];
+  auto closing = m_closing.find(room_name);
+  if (log == nullptr && closing != m_closing.end()) { // the flusher is still writing it out
+    log = closing->second;
+    m_closing.erase(closing);
+  }
+  if (log == nullptr) {
+    log = new RoomLog(m_dir, room_name);
+    auto closed = m_closed.find(room_name);
+    if (closed != m_closed.end()) { // carry on where the last room left off
+      log->m_segments = std::move(closed->second.segments);
+      log->m_next_seq = closed->second.next_seq;
+      m_closed.erase(closed);
+    }
+  }
+  log->m_opens++;
+  return log;
+}
+
+void MessageLog::close_room_log(RoomLog *log) {
+  // the flusher frees it, unless the room is created again first
+  Guard guard(m_lock);
+  log->m_opens--;
+}
+
+// every sync_ms milliseconds, write out and sync whatever has been logged
+void *MessageLog::flusher(void *arg) {
+  MessageLog *log = static_cast<MessageLog *>(arg);
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  while (true) {
+    deadline.tv_nsec += (long) log->m_sync_ms * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    {
+      Guard guard(log->m_lock);
+      while (!log->m_stopping && pthread_cond_timedwait(&log->m_stop, &log->m_lock, &deadline) != ETIMEDOUT)
+        ;
+      if (log->m_stopping)
+        break;
+    }
+    log->flush_all(true);
+  }
+  return nullptr;
+}
+
+void MessageLog::flush_all(bool sync) {
+  std::vector<RoomLog *> rooms;
+  {
+    Guard guard(m_lock);
+    rooms.reserve(m_rooms.size());
+    for (auto &entry : m_rooms)
+      rooms.push_back(entry.second);
+  }
+  for (RoomLog *room : rooms) {
+    size_t written = room->flush(sync);
+    if (written > 0) {
+      m_bytes_written += written;
+      if (sync)
+        m_syncs++;
+    }
+  }
+  close_unused(sync);
+}
+
+// Only the flusher (or the destructor) frees a RoomLog, so the logs
+// flush_all is flushing stay alive; and since a closed log has had its
+// last append, what is left to write out here is at most a little.
+// The writing and syncing happen with m_lock released, so rooms being
+// created meanwhile don't wait for the disk: a log being closed waits
+// in m_closing, where open_room_log takes it back if its room is
+// created again.
+void MessageLog::close_unused(bool sync) {
+  std::vector<RoomLog *> closing;
+  {
+    Guard guard(m_lock);
+    for (auto entry = m_rooms.begin(); entry != m_rooms.end(); ) {
+      if (entry->second->m_opens > 0) {
+        ++entry;
+        continue;
+      }
+      closing.push_back(entry->second);
+      m_closing[entry->first] = entry->second;
+      entry = m_rooms.erase(entry);
+    }
+  }
+  for (RoomLog *log : closing)
+    m_bytes_written += log->flush(sync);
+  {
+    Guard guard(m_lock);
+    for (RoomLog *&log : closing) {
+      auto entry = m_closing.find(log->m_room_name);
+      if (entry == m_closing.end() || entry->second != log) { // in use again
+        log = nullptr;
+        continue;
+      }
+      if (log->m_next_seq > 0)
+        m_closed[entry->first] = ClosedLog{ std::move(log->m_segments), log->m_next_seq };
+      m_closing.erase(entry);
+    }
+  }
+  for (RoomLog *log : closing)
+    delete log; // closes the newest segment
+}
+
+void MessageLog::report(std::ostream &out) {
+  out << "log: " << m_bytes_written.load() << " bytes written, "
+      << m_syncs.load() << " fsyncs\n";
+}
@@ -0,0 +1,153 @@
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include <string>
+#include <atomic>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <ostream>
+#include <pthread.h>
+#include "message.h"
+
+class RoomHistory;
+
+// The deliveries of one room, appended to a series of segment files
+// named after the room and the sequence number each segment starts at.
+// A broadcast only copies its record into a buffer in memory; the
+// MessageLog's flusher writes the buffers out and fsyncs them a batch
+// at a time, so a broadcast never waits for the disk. A segment is
+// closed once it holds SEGMENT_BYTES, and only the newest
+// KEEP_SEGMENTS of a room's segments are kept.
+//
+// Each record is a header (length, checksum, sequence number) followed
+// by the delivery's data; a torn record at the end of a segment, left
+// by a crash mid-write, fails its checksum and ends the segment.
+class RoomLog {
+public:
+  static const size_t SEGMENT_BYTES = 1 << 20;
+  static const size_t KEEP_SEGMENTS = 4;
+
+  RoomLog(const std::string &dir, const std::string &room_name);
+  ~RoomLog();
+
+  // record a delivery (called by every broadcast)
+  void append(uint64_t seq, const Frame &frame);
+
+  // Write out what has been appended, and if sync, make it durable.
+  // Returns the number of bytes written.
+  size_t flush(bool sync);
+
+  // Put the room's logged deliveries back into a new room's history:
+  // the history continues from the last sequence number logged, and
+  // holds as many of the latest deliveries as it has room for. The
+  // segments are read through mmap.
+  void restore(RoomHistory &history);
+
+private:
+  friend class MessageLog;
+
+  // value semantics prohibited
+  RoomLog(const RoomLog &);
+  RoomLog &operator=(const RoomLog &);
+
+  struct Segment {
+    uint64_t first_seq;
+    std::string path;
+  };
+
+  // with m_file_lock held
+  size_t write_pending();
+  void write_out(const char *data, size_t size);
+  bool open_segment(uint64_t first_seq);
+  void remove_old_segments();
+  // scan a segment (mapped at data, size bytes long), calling fn for
+  // each intact record; returns the length of the intact prefix
+  template <typename Fn>
+  static size_t scan(const char *data, size_t size, Fn fn);
+  // cut a segment's torn tail off; returns the highest sequence number
+  // in it, or -1 if none
+  int64_t recover_segment(const Segment &segment);
+
+  std::string m_dir;
+  std::string m_room_name;
+
+  pthread_mutex_t m_lock; // protects m_pending
+  std::string m_pending; // records appended but not yet written
+  std::string m_writing; // the records being written (with m_file_lock held)
+
+  pthread_mutex_t m_file_lock; // protects everything below
+  std::vector<Segment> m_segments; // oldest first
+  int m_fd; // the newest segment, or -1 before it is opened
+  size_t m_segment_size;
+  bool m_unsynced; // written since the last fsync
+  uint64_t m_next_seq; // one past the highest sequence number logged
+
+  int m_opens; // rooms using the log (with the MessageLog's m_lock held)
+};
+
+// The server's optional write-ahead log of room deliveries, kept in a
+// directory with the segments of every room the server has had.
+// When the server starts, the directory's segments are checked and any
+// torn tails removed; a room created later (after a restart, or again
+// after everyone left it) restores its history from its log.
+//
+// Only the rooms that exist have a RoomLog (and a segment open): once
+// a room is deleted, the flusher writes out the rest of its log, closes
+// it and keeps just the list of its segments.
+//
+// Group commit: a flusher thread writes out every room's new records
+// and fsyncs them each sync_ms milliseconds, one fsync per room for
+// however many deliveries arrived in between. A crash loses at most the
+// deliveries of the last sync_ms milliseconds.
+class MessageLog {
+public:
+  MessageLog(const std::string &dir, int sync_ms);
+  ~MessageLog(); // writes out and syncs everything
+
+  // create the directory if need be, recover the rooms' segments and
+  // start the flusher; false (with a message on stderr) on failure
+  bool open();
+
+  // the log for a new room to use until the room is deleted, opened if
+  // no room is using it (a room of the same name may have just gone)
+  RoomLog *open_room_log(const std::string &room_name);
+
+  // the room using the log is being deleted
+  void close_room_log(RoomLog *log);
+
+  // bytes written and fsyncs done so far
+  void report(std::ostream &out);
+
+private:
+  // value semantics prohibited
+  MessageLog(const MessageLog &);
+  MessageLog &operator=(const MessageLog &);
+
+  static void *flusher(void *arg);
+  void flush_all(bool sync);
+  // write out, close and free the logs no room uses
+  void close_unused(bool sync);
+
+  // what is kept of a room's log while no room uses it
+  struct ClosedLog {
+    std::vector<RoomLog::Segment> segments;
+    uint64_t next_seq;
+  };
+
+  std::string m_dir;
+  int m_sync_ms;
+
+  pthread_mutex_t m_lock; // protects m_rooms, m_closing, m_closed and m_stopping
+  pthread_cond_t m_stop;
+  bool m_stopping;
+  bool m_running; // the flusher has been started
+  pthread_t m_thread;
+  std::map<std::string, RoomLog *> m_rooms; // the open logs
+  std::map<std::string, RoomLog *> m_closing; // unused logs the flusher is writing out
+  std::map<std::string, ClosedLog> m_closed; // the rest of the rooms with segments
+
+  std::atomic<uint64_t> m_bytes_written, m_syncs;
+};
+
+#endif // MESSAGE_LOG_H
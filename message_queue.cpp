@@ -1,37 +1,303 @@
 #include "message_queue.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
 #include <ctime>
 #include "message.h"
 #include "guard.h"
 
-MessageQueue::MessageQueue() {
+namespace {
+  void init_cond(pthread_cond_t &cond) {
+    // timed waits are measured against the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+}
+
+#ifdef MQUEUE_RING
+
+MessageQueue::MessageQueue(const Limits &limits)
+  : m_limits(limits)
+  , m_dropped(0)
+  , m_closed(false)
+  , m_notify(nullptr)
+  , m_notify_arg(nullptr)
+  , m_ring(limits.capacity > 0 ? limits.capacity : RING_CAPACITY)
+  , m_size(0)
+  , m_waiters(0) {
+  m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); // initialize the wakeup descriptor
+  init_cond(m_space);
+  pthread_mutex_init(&m_wait_lock, nullptr);
+}
+
+MessageQueue::~MessageQueue() {
+  close(m_eventfd); // release the wakeup descriptor
+  pthread_cond_destroy(&m_space);
+  pthread_mutex_destroy(&m_wait_lock);
+}
+
+bool MessageQueue::enqueue(const FramePtr &frame) {
+  if (m_closed) {
+    m_dropped++;
+    return false;
+  }
+  bool dropped = false;
+  while (!m_ring.push(frame)) { // the receiver is too far behind
+    if (m_limits.policy == DROP_OLDEST) {
+      FramePtr oldest;
+      if (m_ring.pop(oldest)) { // make room, then try again
+        m_size.fetch_sub(1);
+        m_dropped++;
+        dropped = true;
+      }
+    } else if (m_limits.policy == BLOCK) {
+      struct timespec ts;
+      deadline(ts);
+      bool pushed = false;
+      m_waiters++;
+      {
+        Guard guard(m_wait_lock);
+        // the consumer broadcasts m_space after every pop while
+        // m_waiters is nonzero, so retrying under the lock can't miss it
+        while (!(pushed = m_ring.push(frame)) && !m_closed) {
+          if (pthread_cond_timedwait(&m_space, &m_wait_lock, &ts) == ETIMEDOUT) {
+            pushed = m_ring.push(frame);
+            break;
+          }
+        }
+      }
+      m_waiters--;
+      if (!pushed) {
+        m_dropped++;
+        return false;
+      }
+      break;
+    } else {
+      m_dropped++;
+      if (m_limits.policy == DISCONNECT)
+        close_queue();
+      return false;
+    }
+  }
+  // count the frame only once it is published, so a consumer that
+  // sees m_size > 0 is guaranteed to be able to pop something
+  if (m_size.fetch_add(1) == 0)
+    signal(); // wake the receiver, it has something to deliver now
+  return !dropped;
+}
+
+FramePtr MessageQueue::try_dequeue() {
+  FramePtr frame;
+  if (m_closed)
+    return nullptr;
+  if (!m_ring.pop(frame)) {
+    // A producer may have signalled after we already consumed its
+    // frame; clear that so the receiver doesn't spin on the eventfd.
+    clear_signal();
+    return nullptr;
+  }
+  if (m_size.fetch_sub(1) == 1)
+    clear_signal(); // drained, so stop signalling the receiver
+  // make the freed slot visible before checking for blocked senders
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_waiters.load() > 0) {
+    Guard guard(m_wait_lock);
+    pthread_cond_broadcast(&m_space);
+  }
+  return frame;
+}
+
+size_t MessageQueue::dequeue_batch(std::vector<FramePtr> &batch, size_t max_frames, size_t max_bytes) {
+  size_t taken = 0, bytes = 0;
+  FramePtr frame;
+  while (taken < max_frames && bytes < max_bytes && !m_closed && m_ring.pop(frame)) {
+    bytes += frame->size();
+    batch.push_back(std::move(frame));
+    taken++;
+  }
+  if (taken == 0) {
+    clear_signal(); // as in try_dequeue, the signal may be stale
+    return 0;
+  }
+  if (m_size.fetch_sub(taken) == taken)
+    clear_signal(); // drained, so stop signalling the receiver
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_waiters.load() > 0) {
+    Guard guard(m_wait_lock);
+    pthread_cond_broadcast(&m_space);
+  }
+  return taken;
+}
+
+// Producers only signal on the empty to non-empty transition, so a
+// frame published between our decrement and the read must re-arm it.
+void MessageQueue::clear_signal() {
+  if (m_notify.load() != nullptr)
+    return; // nothing to clear, each notification is a single call
+  uint64_t count;
+  ssize_t rc = read(m_eventfd, &count, sizeof(count));
+  (void) rc;
+  if (m_size.load() > 0)
+    signal();
+}
+
+void MessageQueue::close_queue() {
+  m_closed = true;
+  signal(); // the receiver must wake up to notice
+  Guard guard(m_wait_lock);
+  pthread_cond_broadcast(&m_space);
+}
+
+#else
+
+MessageQueue::MessageQueue(const Limits &limits)
+  : m_limits(limits)
+  , m_dropped(0)
+  , m_closed(false)
+  , m_notify(nullptr)
+  , m_notify_arg(nullptr)
+  , m_waiters(0) {
   pthread_mutex_init(&m_lock, nullptr); // initialize the mutex
-  sem_init(&m_avail, 0, 0); // initialize the semaphore
+  m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); // initialize the wakeup descriptor
+  init_cond(m_space);
 }
 
 MessageQueue::~MessageQueue() {
   pthread_mutex_destroy(&m_lock); // destroy the mutex
-  sem_destroy(&m_avail); // destroy the semaphore
+  close(m_eventfd); // release the wakeup descriptor
+  pthread_cond_destroy(&m_space);
 }
 
-void MessageQueue::enqueue(Message *msg) {
+bool MessageQueue::enqueue(const FramePtr &frame) {
   Guard guard(m_lock); // ensure only one thread accesses the queue at a time
-  m_messages.push_back(new Message((*msg).tag, (*msg).data)); // add the message to the back of the queue
-  sem_post(&m_avail); // notifies any waiting thread that a message is available
-}
-
-Message *MessageQueue::dequeue() {
-  struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts); // get the current time
-  // compute a time one second in the future
-  ts.tv_sec += 1;
-  Message *msg = nullptr;
-  if (sem_timedwait(&m_avail, &ts) == -1) // wait up to 1 second for a message
-    return msg; // if nothing comes, return nullptr
-  //otherwise a message is available
+  if (m_closed) {
+    m_dropped++;
+    return false;
+  }
+  bool dropped = false;
+  if (m_limits.capacity > 0 && m_messages.size() >= m_limits.capacity) {
+    // the receiver is too far behind
+    if (m_limits.policy == DROP_OLDEST) {
+      m_messages.pop_front();
+      m_dropped++;
+      dropped = true;
+    } else if (m_limits.policy == BLOCK) {
+      struct timespec ts;
+      deadline(ts);
+      m_waiters++;
+      while (m_messages.size() >= m_limits.capacity && !m_closed) {
+        if (pthread_cond_timedwait(&m_space, &m_lock, &ts) == ETIMEDOUT)
+          break;
+      }
+      m_waiters--;
+      if (m_messages.size() >= m_limits.capacity || m_closed) {
+        m_dropped++;
+        return false;
+      }
+    } else {
+      m_dropped++;
+      if (m_limits.policy == DISCONNECT)
+        close_queue();
+      return false;
+    }
+  }
+  m_messages.push_back(frame); // add the message to the back of the queue
+  if (m_messages.size() == 1) // wake the receiver, it has something to deliver now
+    signal();
+  return !dropped;
+}
+
+FramePtr MessageQueue::try_dequeue() {
   Guard guard(m_lock); // ensure only one thread accesses the queue at a time
-  if (!m_messages.empty()) { // if the queue isn't empty, then store and remove the first message
-    msg = m_messages.front();
+  if (m_messages.empty() || m_closed)
+    return nullptr;
+  FramePtr frame = std::move(m_messages.front());
+  m_messages.pop_front();
+  if (m_messages.empty()) // drained, so stop signalling the receiver
+    clear_signal();
+  if (m_waiters > 0) // a blocked sender can go ahead now
+    pthread_cond_broadcast(&m_space);
+  return frame;
+}
+
+size_t MessageQueue::dequeue_batch(std::vector<FramePtr> &batch, size_t max_frames, size_t max_bytes) {
+  Guard guard(m_lock); // one lock acquisition for the whole batch
+  if (m_closed)
+    return 0;
+  size_t taken = 0, bytes = 0;
+  while (taken < max_frames && bytes < max_bytes && !m_messages.empty()) {
+    bytes += m_messages.front()->size();
+    batch.push_back(std::move(m_messages.front()));
     m_messages.pop_front();
-  } 
-  return msg; // return the message, which will be nullptr if there was no message on the queue
-}
\ No newline at end of file
+    taken++;
+  }
+  if (taken > 0 && m_messages.empty()) // drained, so stop signalling the receiver
+    clear_signal();
+  if (taken > 0 && m_waiters > 0) // blocked senders can go ahead now
+    pthread_cond_broadcast(&m_space);
+  return taken;
+}
+
+void MessageQueue::clear_signal() {
+  if (m_notify.load() != nullptr)
+    return; // nothing to clear, each notification is a single call
+  uint64_t count;
+  ssize_t rc = read(m_eventfd, &count, sizeof(count));
+  (void) rc;
+}
+
+// called with m_lock held
+void MessageQueue::close_queue() {
+  m_closed = true;
+  m_messages.clear(); // nothing more will be delivered
+  signal(); // the receiver must wake up to notice
+  pthread_cond_broadcast(&m_space);
+}
+
+#endif
+
+void MessageQueue::set_notify(Notify notify, void *arg) {
+  m_notify_arg = arg;
+  m_notify.store(notify); // publishes m_notify_arg along with it
+}
+
+void MessageQueue::signal() {
+  Notify notify = m_notify.load();
+  if (notify != nullptr) {
+    notify(m_notify_arg, this);
+    return;
+  }
+  uint64_t one = 1;
+  ssize_t rc = write(m_eventfd, &one, sizeof(one));
+  (void) rc; // can only fail if the counter is already nonzero
+}
+
+// the time at which a blocked sender gives up
+void MessageQueue::deadline(struct timespec &ts) const {
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_sec += m_limits.block_timeout_ms / 1000;
+  ts.tv_nsec += (long) (m_limits.block_timeout_ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+}
+
+FramePtr MessageQueue::dequeue() {
+  while (!is_closed()) {
+    FramePtr frame = try_dequeue();
+    if (frame != nullptr)
+      return frame;
+    // sleep until an enqueue signals the eventfd
+    struct pollfd pfd;
+    pfd.fd = m_eventfd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      return nullptr;
+  }
+  return nullptr;
+}
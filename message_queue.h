@@ -1,33 +1,121 @@
 #ifndef MESSAGE_QUEUE_H
 #define MESSAGE_QUEUE_H
 
-#include <deque>
+#include <atomic>
+#include <cstdint>
+#include <vector>
 #include <pthread.h>
-#include <semaphore.h>
-struct Message;
+#include "message.h"
+#ifdef MQUEUE_RING
+#include "ring_buffer.h"
+#else
+#include <deque>
+#endif
 
-// This data type represents a queue of Messages waiting to
-// be delivered to a receiver
+// This data type represents a queue of encoded messages waiting to
+// be delivered to a receiver. Frames are shared, not copied, so a
+// broadcast costs one reference count per member.
+//
+// There are two implementations, chosen at build time (see MQUEUE in
+// the Makefile): by default a std::deque guarded by a mutex, or with
+// MQUEUE_RING a lock-free ring, so that senders broadcasting into a
+// busy room don't contend on each receiver's lock.
+//
+// A queue holds at most a fixed number of messages, so that a receiver
+// that stops reading can't make the server's memory grow without
+// limit; what happens to a message that doesn't fit is up to the
+// queue's OverflowPolicy.
 class MessageQueue {
 public:
-  MessageQueue();
+  // what enqueue does when the queue is full
+  enum OverflowPolicy {
+    DROP_OLDEST, // discard the oldest queued message to make room
+    DROP_NEWEST, // discard the message being enqueued
+    DISCONNECT,  // discard it and close the queue, disconnecting the receiver
+    BLOCK,       // wait up to block_timeout_ms for room, then discard it
+                 // (on the sender's thread, so threads mode only)
+  };
+
+  struct Limits {
+    size_t capacity; // 0 means unbounded (deque implementation only)
+    OverflowPolicy policy;
+    int block_timeout_ms;
+
+    Limits() : capacity(1024), policy(DROP_OLDEST), block_timeout_ms(100) { }
+  };
+
+  // number of frames the ring implementation holds when unbounded
+  // is requested (the ring's capacity is always a power of two)
+  static const size_t RING_CAPACITY = 1024;
+
+  MessageQueue(const Limits &limits = Limits());
   ~MessageQueue();
 
-  void enqueue(Message *msg); // will not block
-  Message *dequeue();         // blocks for at most a finite amount of time
+  // Will not block, except under the BLOCK policy. Returns false if
+  // this message or an older one had to be dropped to respect the
+  // queue's capacity.
+  bool enqueue(const FramePtr &frame);
+  FramePtr dequeue();                  // blocks until a message is available
+  FramePtr try_dequeue();              // never blocks, returns nullptr if empty
+
+  // Never blocks. Moves queued frames to the end of batch, stopping
+  // once max_frames frames or at least max_bytes bytes have been taken.
+  // Returns the number of frames taken.
+  size_t dequeue_batch(std::vector<FramePtr> &batch, size_t max_frames, size_t max_bytes);
+
+  // An eventfd that is readable exactly when the queue is non-empty
+  // (or has been closed), so a receiver can wait for deliveries and its
+  // socket at the same time with poll, or register the queue with an
+  // epoll event loop.
+  int get_fd() const { return m_eventfd; }
+
+  // Instead of the eventfd, call notify(arg, this) whenever the queue
+  // becomes non-empty (or is closed), on the thread that enqueued. This
+  // lets an event loop gather the wakeups of many receivers into one.
+  typedef void (*Notify)(void *arg, MessageQueue *queue);
+  void set_notify(Notify notify, void *arg);
+
+  // true once the DISCONNECT policy has given up on the receiver;
+  // a closed queue delivers and accepts nothing more
+  bool is_closed() const { return m_closed.load(); }
+
+  // number of messages this queue has dropped
+  uint64_t get_dropped() const { return m_dropped.load(); }
 
 private:
   // value semantics prohibited
   MessageQueue(const MessageQueue &);
   MessageQueue &operator=(const MessageQueue &);
 
-  // these data members are sufficient to implement the
-  // enqueue and dequeue operations: the idea is that the semaphore
-  // keeps a count of how many messages are currently in the queue
+  void signal();
+  void clear_signal();
+  void close_queue();
+  void deadline(struct timespec &ts) const;
+
+  Limits m_limits;
+  std::atomic<uint64_t> m_dropped;
+  std::atomic<bool> m_closed;
+
+  // the eventfd is signalled when the queue goes from empty to
+  // non-empty and cleared when it is drained, so an idle receiver is
+  // never woken without a message to deliver
+  int m_eventfd;
+  std::atomic<Notify> m_notify; // replaces the eventfd if set
+  void *m_notify_arg;
+
+  // senders blocked waiting for room wait on m_space
+  pthread_cond_t m_space;
 
+#ifdef MQUEUE_RING
+  RingBuffer<FramePtr> m_ring;
+  std::atomic<size_t> m_size;    // published frames not yet dequeued
+  std::atomic<int> m_waiters;    // senders blocked on m_space
+  pthread_mutex_t m_wait_lock;   // only used by blocked senders
+#else
   pthread_mutex_t m_lock; // must be held while accessing queue
-  sem_t m_avail;
-  std::deque<Message *> m_messages;
+  int m_waiters;          // senders blocked on m_space
+  std::deque<FramePtr> m_messages;
+#endif
 };
 
 #endif // MESSAGE_QUEUE_H
@@ -0,0 +1,314 @@
+// Microbenchmarks for the server's hot paths, written as JSON so that
+// results can be recorded for each commit and compared:
+//
+//   mqueue       producer threads enqueue into one MessageQueue while a
+//                consumer drains it in batches, as a receiver does
+//   broadcast    Room::broadcast_message into rooms of 10, 100 and
+//                10000 members
+//   receive      Connection::receive of lines and of version 2 frames
+//                written into a socketpair by another thread
+//   send         Connection::send of single messages and of batches of
+//                frames into a socketpair drained by another thread
+//
+// The queue implementation is whichever the Makefile's MQUEUE selects.
+// "make bench-micro" runs it, labelling the results with the current
+// git commit.
+//
+// Usage: micro_bench [-c commit] [output file] (default: standard output)
+
+#include <sys/socket.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "message.h"
+#include "message_queue.h"
+#include "connection.h"
+#include "room.h"
+#include "user.h"
+#include "name.h"
+
+using std::string;
+
+#ifdef MQUEUE_RING
+static const char *BACKEND = "ring";
+#else
+static const char *BACKEND = "deque";
+#endif
+
+namespace {
+  // one measurement: ops operations of some kind took seconds
+  struct Result {
+    string name;
+    string params; // a JSON object's members, e.g. "\"producers\": 4"
+    long ops;
+    double seconds;
+  };
+
+  std::vector<Result> g_results;
+
+  double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  void record(const string &name, const string &params, long ops, double seconds) {
+    g_results.push_back(Result{ name, params, ops, seconds });
+    fprintf(stderr, "%-20s %-20s %12.0f ops/s\n", name.c_str(), params.c_str(), ops / seconds);
+  }
+
+  void write_json(FILE *out, const char *commit) {
+    fprintf(out, "{\n  \"commit\": \"%s\",\n  \"mqueue_backend\": \"%s\",\n  \"results\": [\n",
+            commit, BACKEND);
+    for (size_t i = 0; i < g_results.size(); i++) {
+      const Result &r = g_results[i];
+      fprintf(out, "    {\"name\": \"%s\", \"params\": {%s}, \"ops\": %ld, \"seconds\": %.6f, "
+              "\"ops_per_sec\": %.1f, \"ns_per_op\": %.2f}%s\n",
+              r.name.c_str(), r.params.c_str(), r.ops, r.seconds, r.ops / r.seconds,
+              r.seconds * 1e9 / r.ops, (i + 1 < g_results.size()) ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+  }
+
+  // the event loops' way of being told about deliveries, which costs
+  // no system call (unlike the eventfd a queue signals by default)
+  void ignore_notify(void *, MessageQueue *) { }
+
+  //
+  // MessageQueue under contention
+  //
+
+  struct Producer {
+    MessageQueue *queue;
+    FramePtr frame;
+    long count;
+  };
+
+  void *produce(void *arg) {
+    Producer *p = static_cast<Producer *>(arg);
+    for (long i = 0; i < p->count; i++)
+      while (!p->queue->enqueue(p->frame)) // full: let the consumer catch up
+        sched_yield();
+    return nullptr;
+  }
+
+  void bench_mqueue(int num_producers, long total) {
+    MessageQueue::Limits limits;
+    limits.capacity = MessageQueue::RING_CAPACITY;
+    limits.policy = MessageQueue::DROP_NEWEST;
+    MessageQueue queue(limits);
+    queue.set_notify(ignore_notify, nullptr);
+    FramePtr frame = std::make_shared<const Frame>(TAG_DELIVERY, "room:sender:benchmark payload");
+    std::vector<Producer> producers(num_producers);
+    std::vector<pthread_t> threads(num_producers);
+    long per_producer = total / num_producers;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_producers; i++) {
+      producers[i] = Producer{ &queue, frame, per_producer };
+      pthread_create(&threads[i], nullptr, produce, &producers[i]);
+    }
+    std::vector<FramePtr> batch;
+    for (long received = 0; received < per_producer * num_producers; ) {
+      batch.clear();
+      size_t n = queue.dequeue_batch(batch, 256, SIZE_MAX);
+      if (n == 0)
+        sched_yield();
+      received += n;
+    }
+    double secs = seconds_since(start);
+    for (int i = 0; i < num_producers; i++)
+      pthread_join(threads[i], nullptr);
+    record("mqueue", "\"producers\": " + std::to_string(num_producers),
+           per_producer * num_producers, secs);
+  }
+
+  //
+  // Room::broadcast_message
+  //
+
+  void bench_broadcast(int num_members, long deliveries) {
+    Room room("bench");
+    std::vector<std::shared_ptr<User> > members;
+    for (int i = 0; i < num_members; i++) {
+      members.push_back(std::make_shared<User>("member" + std::to_string(i)));
+      members.back()->mqueue.set_notify(ignore_notify, nullptr);
+      room.add_member(members.back());
+    }
+    Name sender("sender");
+    string prefix = room.delivery_prefix(sender);
+    string text = "a message of typical length from the broadcast benchmark";
+
+    // broadcast in rounds that fit in the members' queues, emptying
+    // them (untimed) between rounds
+    long broadcasts = std::max(1L, deliveries / num_members);
+    long round = std::min(broadcasts, 512L);
+    double secs = 0;
+    std::vector<FramePtr> batch;
+    for (long done = 0; done < broadcasts; done += round) {
+      auto start = std::chrono::steady_clock::now();
+      for (long i = 0; i < round; i++)
+        room.broadcast_message(sender, prefix, text);
+      secs += seconds_since(start);
+      for (auto &member : members) {
+        batch.clear();
+        while (member->mqueue.dequeue_batch(batch, SIZE_MAX, SIZE_MAX) > 0)
+          batch.clear();
+      }
+    }
+    long total = (broadcasts + round - 1) / round * round;
+    record("broadcast", "\"members\": " + std::to_string(num_members), total, secs);
+    record("broadcast_delivery", "\"members\": " + std::to_string(num_members),
+           total * num_members, secs);
+    for (auto &member : members)
+      room.remove_member(member);
+  }
+
+  //
+  // Connection::receive and Connection::send over a socketpair
+  //
+
+  struct Pump {
+    int fd;
+    const string *data; // written repeatedly, if set
+    long repeat;
+  };
+
+  // write the data repeatedly, then close
+  void *write_repeatedly(void *arg) {
+    Pump *p = static_cast<Pump *>(arg);
+    for (long i = 0; i < p->repeat; i++) {
+      size_t done = 0;
+      while (done < p->data->size()) {
+        ssize_t n = write(p->fd, p->data->data() + done, p->data->size() - done);
+        if (n <= 0)
+          return nullptr;
+        done += n;
+      }
+    }
+    shutdown(p->fd, SHUT_WR);
+    return nullptr;
+  }
+
+  // read and discard until EOF
+  void *drain(void *arg) {
+    Pump *p = static_cast<Pump *>(arg);
+    char buf[65536];
+    while (read(p->fd, buf, sizeof(buf)) > 0)
+      ;
+    return nullptr;
+  }
+
+  void bench_receive(int protocol, long total) {
+    // a block of the requests a busy sender makes, written over and over
+    const int PER_BLOCK = 1000;
+    string block;
+    for (int i = 0; i < PER_BLOCK; i++) {
+      string data = "message number " + std::to_string(i) + " from the receive benchmark";
+      if (protocol == 1) {
+        block += TAG_SENDALL;
+        block += ':';
+        block += data;
+        block += '\n';
+      } else {
+        unsigned char header[MAX_VARINT_LEN + 1];
+        unsigned header_len = encode_varint(data.size() + 1, header);
+        header[header_len++] = TAGC_SENDALL;
+        block.append((const char *) header, header_len);
+        block += data;
+      }
+    }
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    Pump pump{ fds[1], &block, total / PER_BLOCK };
+    pthread_t writer;
+    auto start = std::chrono::steady_clock::now();
+    pthread_create(&writer, nullptr, write_repeatedly, &pump);
+    long count = 0;
+    {
+      Connection conn(fds[0]);
+      conn.set_protocol(protocol);
+      Message msg;
+      while (conn.receive(msg))
+        count++;
+    }
+    double secs = seconds_since(start);
+    pthread_join(writer, nullptr);
+    close(fds[1]);
+    record("receive", "\"protocol\": " + std::to_string(protocol), count, secs);
+  }
+
+  // batch 0 sends one message per call, otherwise batches of frames
+  void bench_send(size_t batch_size, long total) {
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    Pump pump{ fds[1], nullptr, 0 };
+    pthread_t reader;
+    pthread_create(&reader, nullptr, drain, &pump);
+    string data = "room:sender:a message of typical length from the send benchmark";
+    auto start = std::chrono::steady_clock::now();
+    {
+      Connection conn(fds[0]);
+      if (batch_size == 0) {
+        for (long i = 0; i < total; i++)
+          conn.send(TAG_DELIVERY, data);
+      } else {
+        std::vector<FramePtr> frames(batch_size, std::make_shared<const Frame>(TAG_DELIVERY, data));
+        for (long i = 0; i < total; i += batch_size)
+          conn.send(frames);
+      }
+    } // closing the connection ends the reader
+    pthread_join(reader, nullptr);
+    double secs = seconds_since(start);
+    close(fds[1]);
+    long sent = (batch_size == 0) ? total : (total + batch_size - 1) / batch_size * batch_size;
+    record("send", "\"batch\": " + std::to_string(batch_size), sent, secs);
+  }
+
+  void usage() {
+    fprintf(stderr, "Usage: micro_bench [-c commit] [output file] (default: standard output)\n");
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *commit = "";
+  int arg = 1;
+  if (arg + 1 < argc && strcmp(argv[arg], "-c") == 0) {
+    commit = argv[arg + 1];
+    arg += 2;
+  }
+  // anything else that looks like an option (-h, a mistyped flag) is
+  // not taken as the file to overwrite
+  if (argc - arg > 1 || (arg < argc && argv[arg][0] == '-')) {
+    usage();
+    return 1;
+  }
+  FILE *out = stdout;
+  if (arg < argc && (out = fopen(argv[arg], "w")) == nullptr) {
+    perror(argv[arg]);
+    return 1;
+  }
+
+  const int producer_counts[] = { 1, 4, 16 };
+  for (int n : producer_counts)
+    bench_mqueue(n, 2000000);
+
+  const int member_counts[] = { 10, 100, 10000 };
+  for (int n : member_counts)
+    bench_broadcast(n, 5000000);
+
+  bench_receive(1, 2000000);
+  bench_receive(2, 2000000);
+
+  bench_send(0, 500000);
+  bench_send(64, 2000000);
+
+  write_json(out, commit);
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
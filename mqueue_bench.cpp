@@ -0,0 +1,87 @@
+// Microbenchmark for MessageQueue: several producer threads enqueue
+// into one queue while a single consumer drains it, which is what a
+// busy room does to each of its receivers. The Makefile builds this
+// once per queue implementation (mqueue_bench_deque, mqueue_bench_ring)
+// so the two can be compared; "make bench-mqueue" runs both.
+
+#include <pthread.h>
+#include <sched.h>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "message.h"
+#include "message_queue.h"
+
+using std::cout;
+
+#ifdef MQUEUE_RING
+static const char *BACKEND = "ring";
+#else
+static const char *BACKEND = "deque";
+#endif
+
+namespace {
+  struct Producer {
+    MessageQueue *queue;
+    FramePtr frame;
+    long count;
+    long retries; // enqueues refused because the queue was full
+  };
+
+  void *produce(void *arg) {
+    Producer *p = static_cast<Producer *>(arg);
+    for (long i = 0; i < p->count; i++) {
+      while (!p->queue->enqueue(p->frame)) { // full: let the consumer catch up
+        p->retries++;
+        sched_yield();
+      }
+    }
+    return nullptr;
+  }
+
+  void run(int num_producers, long total) {
+    // both implementations get the same bound; a full queue refuses
+    // the new message and the producer retries it
+    MessageQueue::Limits limits;
+    limits.capacity = MessageQueue::RING_CAPACITY;
+    limits.policy = MessageQueue::DROP_NEWEST;
+    MessageQueue queue(limits);
+    FramePtr frame = std::make_shared<const Frame>(TAG_DELIVERY, "room:sender:benchmark payload");
+    std::vector<Producer> producers(num_producers);
+    std::vector<pthread_t> threads(num_producers);
+    long per_producer = total / num_producers;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_producers; i++) {
+      producers[i].queue = &queue;
+      producers[i].frame = frame;
+      producers[i].count = per_producer;
+      producers[i].retries = 0;
+      pthread_create(&threads[i], nullptr, produce, &producers[i]);
+    }
+    // the consumer blocks in dequeue exactly as a receiver would
+    for (long received = 0; received < per_producer * num_producers; received++)
+      queue.dequeue();
+    auto end = std::chrono::steady_clock::now();
+
+    long retries = 0;
+    for (int i = 0; i < num_producers; i++) {
+      pthread_join(threads[i], nullptr);
+      retries += producers[i].retries;
+    }
+    double secs = std::chrono::duration<double>(end - start).count();
+    long msgs = per_producer * num_producers;
+    cout << BACKEND << "\t" << num_producers << "\t" << msgs << "\t" << secs
+         << "\t" << (long) (msgs / secs) << "\t" << retries << "\n";
+  }
+}
+
+int main(int argc, char **argv) {
+  long total = (argc > 1) ? atol(argv[1]) : 1000000;
+  cout << "backend\tproducers\tmessages\tseconds\tmsgs/sec\tfull_retries\n";
+  const int producer_counts[] = { 1, 4, 16, 64 };
+  for (int n : producer_counts)
+    run(n, total);
+  return 0;
+}
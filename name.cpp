@@ -0,0 +1,34 @@
+#include <unordered_map>
+#include <pthread.h>
+#include "guard.h"
+#include "name.h"
+
+namespace {
+  // Names are only made at login, so one lock is plenty. The table
+  // and its lock are never destroyed: a Name may outlive main.
+  pthread_mutex_t g_names_lock = PTHREAD_MUTEX_INITIALIZER;
+  std::unordered_map<std::string, std::weak_ptr<const std::string> > &g_names =
+    *new std::unordered_map<std::string, std::weak_ptr<const std::string> >;
+
+  // called when the last Name for a string goes away
+  void forget(const std::string *str) {
+    {
+      Guard guard(g_names_lock);
+      auto it = g_names.find(*str);
+      // the string may have been interned again in the meantime
+      if (it != g_names.end() && it->second.expired())
+        g_names.erase(it);
+    }
+    delete str;
+  }
+}
+
+Name::Name(const std::string &str) {
+  Guard guard(g_names_lock);
+  std::weak_ptr<const std::string> &entry = g_names[str];
+  m_str = entry.lock();
+  if (!m_str) {
+    m_str = std::shared_ptr<const std::string>(new std::string(str), forget);
+    entry = m_str;
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef NAME_H
+#define NAME_H
+
+#include <string>
+#include <memory>
+#include <ostream>
+
+// An interned user name. Every Name made from the same string shares
+// one copy of it, so two Names are equal exactly when they point at
+// the same string: a broadcast tells the sender apart from the
+// room's members by comparing pointers, not characters. A string
+// stays interned for as long as some Name refers to it.
+class Name {
+public:
+  Name() { }
+  explicit Name(const std::string &str);
+
+  const std::string &str() const { return *m_str; }
+
+  bool operator==(const Name &other) const { return m_str == other.m_str; }
+  bool operator!=(const Name &other) const { return m_str != other.m_str; }
+
+private:
+  std::shared_ptr<const std::string> m_str;
+};
+
+inline std::ostream &operator<<(std::ostream &out, const Name &name) {
+  return out << name.str();
+}
+
+#endif // NAME_H
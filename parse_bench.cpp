@@ -0,0 +1,114 @@
+// Microbenchmark for Connection::receive: a file of encoded messages
+// is read back through the old receive (rio_readlineb, then a
+// stringstream and two getline calls to split the line), through
+// Connection::receive, which splits lines in place in its input
+// buffer, and through Connection::receive reading the same messages
+// as protocol version 2 frames. All of them read through the same 8KB
+// buffer, so the difference is the cost of parsing. "make bench-parse"
+// runs it.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "csapp.h"
+#include "message.h"
+#include "connection.h"
+
+using std::cout;
+using std::string;
+
+namespace {
+  // how Connection::receive used to parse each line
+  bool old_receive(rio_t *rio, Message &msg) {
+    char buf[Message::MAX_LEN + 1];
+    ssize_t status = rio_readlineb(rio, buf, Message::MAX_LEN);
+    if (status <= 0)
+      return false;
+    std::stringstream sstream(buf);
+    string tag;
+    getline(sstream, tag, ':');
+    msg.tag = tag;
+    getline(sstream, msg.data);
+    return true;
+  }
+
+  long run_old(const char *path) {
+    int fd = open(path, O_RDONLY);
+    rio_t rio;
+    rio_readinitb(&rio, fd);
+    Message msg;
+    long count = 0;
+    while (old_receive(&rio, msg))
+      count++;
+    close(fd);
+    return count;
+  }
+
+  long run_new(const char *path) {
+    Connection conn(open(path, O_RDONLY));
+    Message msg;
+    long count = 0;
+    while (conn.receive(msg))
+      count++;
+    return count;
+  }
+
+  long run_frames(const char *path) {
+    Connection conn(open(path, O_RDONLY));
+    conn.set_protocol(2);
+    Message msg;
+    long count = 0;
+    while (conn.receive(msg))
+      count++;
+    return count;
+  }
+
+  void report(const char *parser, long (*run)(const char *), const char *path) {
+    auto start = std::chrono::steady_clock::now();
+    long msgs = run(path);
+    auto end = std::chrono::steady_clock::now();
+    double secs = std::chrono::duration<double>(end - start).count();
+    cout << parser << "\t" << msgs << "\t" << secs << "\t" << (long) (msgs / secs) << "\n";
+  }
+}
+
+int main(int argc, char **argv) {
+  long total = (argc > 1) ? atol(argv[1]) : 2000000;
+
+  // the messages a busy sender produces, as lines and as frames
+  char lines[] = "/tmp/parse_benchXXXXXX";
+  char frames[] = "/tmp/parse_benchXXXXXX";
+  int lines_fd = mkstemp(lines);
+  int frames_fd = mkstemp(frames);
+  if (lines_fd < 0 || frames_fd < 0) {
+    std::cerr << "Could not create temporary files\n";
+    return 1;
+  }
+  FILE *lines_out = fdopen(lines_fd, "w");
+  FILE *frames_out = fdopen(frames_fd, "w");
+  char data[Message::MAX_LEN];
+  for (long i = 0; i < total; i++) {
+    int len = snprintf(data, sizeof(data), "message number %ld from the parse benchmark", i);
+    fprintf(lines_out, "%s:%s\n", TAG_SENDALL, data);
+    unsigned char header[MAX_VARINT_LEN + 1];
+    unsigned header_len = encode_varint(len + 1, header);
+    header[header_len++] = TAGC_SENDALL;
+    fwrite(header, 1, header_len, frames_out);
+    fwrite(data, 1, len, frames_out);
+  }
+  fclose(lines_out);
+  fclose(frames_out);
+
+  cout << "parser\tmessages\tseconds\tmsgs/sec\n";
+  report("stringstream", run_old, lines);
+  report("in-place", run_new, lines);
+  report("v2-frames", run_frames, frames);
+  unlink(lines);
+  unlink(frames);
+  return 0;
+}
@@ -27,8 +27,8 @@ vector<string> split_string(string str, string delimiter) {
 }
 
 int main(int argc, char **argv) {
-  if (argc != 5) {
-    cerr << "Usage: ./receiver [server_address] [port] [username] [room]\n";
+  if (argc < 5) {
+    cerr << "Usage: ./receiver [server_address] [port] [username] [room] [more rooms...]\n";
     return 1;
   }
 
@@ -73,6 +73,13 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  // Any further rooms are joined on the same connection. Their replies
+  // may arrive after deliveries from the rooms already joined, so they
+  // are handled in the loop below.
+  bool many_rooms = argc > 5;
+  for (int i = 5; i < argc; i++)
+    connection.send(Message(TAG_JOIN, argv[i]));
+
   // Loop indefinitely waiting for messages from server (which should be tagged
   // with TAG_DELIVERY)
   while (1) {
@@ -84,8 +91,12 @@ int main(int argc, char **argv) {
       vector<string> data = split_string(
           msg.data,
           ":"); // split the string using helper function with colon delimiter
+      if (many_rooms) // say which room the message is from
+        cout << "[" << data[0] << "] ";
       cout << data[1] << ": "
            << data[2]; // output the user, and their sent message, w/ colon
+    } else if (msg.tag == TAG_ERR) { // e.g. one of the extra rooms couldn't be joined
+      cerr << msg.data << "\n";
     }
   }
   connection.close();
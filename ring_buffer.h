@@ -0,0 +1,111 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// A bounded lock-free queue (Dmitry Vyukov's array-based MPMC
+// algorithm): any number of threads may push and pop at once. Under
+// the drop-oldest policy MessageQueue relies on that, since a sender
+// finding the ring full pops the oldest element itself while the
+// receiver is popping too. Each cell carries a sequence number that
+// tells pushers and poppers whose turn it is, so a push or pop is a
+// single compare-and-swap on its position in the common case.
+//
+// The two positions are separated by padding so that pushers bumping
+// the tail don't keep invalidating the cache line poppers read the
+// head from. (The padding is spelled out instead of using alignas
+// because the ring lives inside each User, which the slab pool
+// allocates with no more than the default alignment.)
+template <typename T>
+class RingBuffer {
+public:
+  // capacity is rounded up to a power of two
+  explicit RingBuffer(size_t capacity)
+    : m_enqueue_pos(0), m_dequeue_pos(0) {
+    size_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+    m_mask = size - 1;
+    m_cells = new Cell[size];
+    for (size_t i = 0; i < size; i++)
+      m_cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  ~RingBuffer() {
+    delete[] m_cells;
+  }
+
+  size_t capacity() const { return m_mask + 1; }
+
+  // returns false, leaving value untouched, if the ring is full
+  bool push(const T &value) {
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &m_cells[pos & m_mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+      if (dif == 0) {
+        if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = m_enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = value;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // returns false if the ring is empty (or the oldest element is
+  // claimed but not yet published by its producer)
+  bool pop(T &value) {
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &m_cells[pos & m_mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+      if (dif == 0) {
+        if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = m_dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    value = std::move(cell->value);
+    cell->value = T(); // don't keep the element alive until the slot is reused
+    cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  // value semantics prohibited
+  RingBuffer(const RingBuffer &);
+  RingBuffer &operator=(const RingBuffer &);
+
+  static const size_t CACHE_LINE = 64;
+
+  struct Cell {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  char m_pad0[CACHE_LINE];
+  Cell *m_cells;
+  size_t m_mask;
+  char m_pad1[CACHE_LINE];
+  std::atomic<size_t> m_enqueue_pos;
+  char m_pad2[CACHE_LINE - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> m_dequeue_pos;
+  char m_pad3[CACHE_LINE - sizeof(std::atomic<size_t>)];
+};
+
+#endif // RING_BUFFER_H
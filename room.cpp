@@ -1,33 +1,101 @@
+#include <algorithm>
 #include "room.h"
 #include "guard.h"
 #include "message.h"
 #include "user.h"
 #include "message_queue.h"
+#include "slab_pool.h"
+#include "message_log.h"
 
-Room::Room(const std::string &room_name)
-  : room_name(room_name) {
+namespace {
+  // every broadcast's Frame (with its reference counts) comes from here
+  struct FramePool { static const char *name() { return "frames"; } };
+  typedef PoolAllocator<Frame, FramePool> FrameAllocator;
+}
+
+Room::Room(const std::string &room_name, size_t history_len, RoomLog *log)
+  : room_name(room_name), dropped(0), refs(0), members(std::make_shared<const UserSet>())
+  , history(history_len), log(log), restored(log == nullptr) {
   pthread_mutex_init(&lock, nullptr); // initialize the mutex
+  pthread_mutex_init(&restore_lock, nullptr);
 }
 
 Room::~Room() {
   pthread_mutex_destroy(&lock); // destroy the mutex
+  pthread_mutex_destroy(&restore_lock);
+}
+
+void Room::restore_history() {
+  if (restored.load())
+    return;
+  Guard guard(restore_lock);
+  if (!restored.load()) {
+    log->restore(history);
+    restored.store(true);
+  }
+}
+
+Room::UserSetPtr Room::snapshot() const {
+  return std::atomic_load(&members);
 }
 
-void Room::add_member(User *user) {
+void Room::add_member(const std::shared_ptr<User> &user) {
   Guard guard(lock); // ensures the list can't be modified simultaneously by multiple threads
-  members.insert(user);
+  UserSetPtr current = snapshot();
+  if (std::find(current->begin(), current->end(), user) != current->end())
+    return;
+  std::shared_ptr<UserSet> updated = std::make_shared<UserSet>(*current);
+  updated->push_back(user);
+  std::atomic_store(&members, UserSetPtr(updated)); // publish the new list
 }
 
-void Room::remove_member(User *user) {
+void Room::remove_member(const std::shared_ptr<User> &user) {
   Guard guard(lock);  // ensures the list can't be modified simultaneously by multiple threads
-  members.erase(user);
+  UserSetPtr current = snapshot();
+  if (std::find(current->begin(), current->end(), user) == current->end())
+    return;
+  std::shared_ptr<UserSet> updated = std::make_shared<UserSet>();
+  updated->reserve(current->size() - 1);
+  for (auto &each : *current)
+    if (each != user)
+      updated->push_back(each);
+  std::atomic_store(&members, UserSetPtr(updated)); // publish the new list
 }
 
-void Room::broadcast_message(const std::string &sender_username, const std::string &message_text) {
-  Guard guard(lock); // ensures broadcasting and adding/removing members aren't simultaneous
+std::string Room::delivery_prefix(const Name &sender) const {
+  return room_name + ":" + sender.str() + ":";
+}
+
+FramePtr Room::make_delivery(const std::string &prefix, const std::string &message_text) {
+  return std::allocate_shared<const Frame>(FrameAllocator(), TAG_DELIVERY, prefix, message_text);
+}
+
+void Room::broadcast_message(const Name &sender, const std::string &prefix, const std::string &message_text) {
+  // encode the delivery once; every member's queue shares the same frame
+  FramePtr frame = make_delivery(prefix, message_text);
+  // Record it before looking at the members: a receiver that joins and
+  // then replays the history either finds it there or is in the list.
+  uint64_t seq = history.append(frame);
+  if (log != nullptr)
+    log->append(seq, *frame);
+  // take the current member list; joins and leaves from here on
+  // replace the list rather than change this one
+  UserSetPtr current = snapshot();
   // iterate through all the users in the room
-  for(auto each: members){
-   if(sender_username != (*each).username) // only if the user isn't the original sender of the message
-      each->mqueue.enqueue(new Message(TAG_DELIVERY, get_room_name() + ":" + sender_username + ":" + message_text)); // send message
+  for(auto &each: *current){
+   if(sender != (*each).username) // only if the user isn't the original sender of the message
+      if (!each->mqueue.enqueue(frame)) // send message
+        dropped++; // the member's queue was full
+  }
+}
+
+void Room::report(std::ostream &out) {
+  UserSetPtr current = snapshot();
+  out << "room " << room_name << ": " << current->size() << " members, "
+      << dropped.load() << " dropped\n";
+  for (auto &each : *current) {
+    uint64_t user_dropped = each->mqueue.get_dropped();
+    if (user_dropped > 0)
+      out << "  user " << each->username << ": " << user_dropped << " dropped\n";
   }
 }
\ No newline at end of file
@@ -2,32 +2,88 @@
 #define ROOM_H
 
 #include <string>
-#include <set>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
 #include <pthread.h>
 
+#include "message.h"
+#include "room_history.h"
+
 struct User;
+class Name;
+class RoomLog;
 
 // A Room object is a representation of a chat room.
 // At a minimum, it should keep track of the User objects representing
 // receivers who have joined the room.
+//
+// The member list is copy-on-write: joining or leaving builds a new,
+// immutable list and swaps it in, and a broadcast walks whichever list
+// was current when it started without holding the room's lock. So a
+// large fan-out never stalls joins, leaves or other senders, and a
+// member keeps its User (and queue) alive for as long as any broadcast
+// may still be delivering to it.
+//
+// A room also remembers its last history_len deliveries, for receivers
+// that join asking to catch up (see RoomHistory). The history lasts as
+// long as the room does, unless the room has a log: then every delivery
+// is logged too, and a new room picks up its history from the log.
 class Room {
 public:
-  Room(const std::string &room_name);
+  Room(const std::string &room_name, size_t history_len = 0, RoomLog *log = nullptr);
   ~Room();
 
-  std::string get_room_name() const { return room_name; }
+  const std::string &get_room_name() const { return room_name; }
+  const RoomHistory &get_history() const { return history; }
+
+  void add_member(const std::shared_ptr<User> &user);
+  void remove_member(const std::shared_ptr<User> &user);
+
+  // A sender's deliveries all begin "room:sender:", so a sender works
+  // that out once when it joins, and each broadcast only appends the
+  // message text to it.
+  std::string delivery_prefix(const Name &sender) const;
+  void broadcast_message(const Name &sender, const std::string &prefix, const std::string &message_text);
+
+  // encode a delivery of prefix followed by message_text (in a pooled Frame)
+  static FramePtr make_delivery(const std::string &prefix, const std::string &message_text);
 
-  void add_member(User *user);
-  void remove_member(User *user);
+  // number of deliveries dropped because a member's queue was full
+  uint64_t get_dropped() const { return dropped.load(); }
 
-  void broadcast_message(const std::string &sender_username, const std::string &message_text);
+  // write the room's drop counters, and those of its members, to out
+  void report(std::ostream &out);
 
 private:
+  // the registry keeps count of the sessions holding each room
+  friend class RoomRegistry;
+
+  typedef std::vector<std::shared_ptr<User> > UserSet;
+  typedef std::shared_ptr<const UserSet> UserSetPtr;
+
+  // the current member list, read and replaced with std::atomic_load
+  // and std::atomic_store
+  UserSetPtr snapshot() const;
+
+  // Fill the history from the log, if the room has one, the first time
+  // this is called; those calling it meanwhile wait until it's done.
+  // The registry calls it for every acquire, after unlocking the shard,
+  // so reading the log only holds up the sessions joining this room.
+  void restore_history();
+
   std::string room_name;
-  pthread_mutex_t lock;
+  pthread_mutex_t lock; // serializes changes to the member list
+  std::atomic<uint64_t> dropped;
+  std::atomic<long> refs;
 
-  typedef std::set<User *> UserSet;
-  UserSet members;
+  UserSetPtr members;
+  RoomHistory history;
+  RoomLog *log; // or nullptr
+  pthread_mutex_t restore_lock; // held while the history is restored
+  std::atomic<bool> restored;
 };
 
 #endif // ROOM_H
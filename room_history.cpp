@@ -0,0 +1,70 @@
+#include <sched.h>
+#include "room_history.h"
+
+RoomHistory::RoomHistory(size_t capacity)
+  : m_slots(nullptr), m_mask(0), m_next(0) {
+  if (capacity == 0)
+    return;
+  size_t size = 1;
+  while (size < capacity)
+    size <<= 1;
+  m_mask = size - 1;
+  m_slots = new Slot[size];
+  for (size_t i = 0; i < size; i++)
+    m_slots[i].tag.store(0, std::memory_order_relaxed);
+}
+
+RoomHistory::~RoomHistory() {
+  delete[] m_slots;
+}
+
+uint64_t RoomHistory::append(const FramePtr &frame) {
+  uint64_t seq = m_next.fetch_add(1);
+  if (m_slots == nullptr)
+    return seq;
+  Slot &slot = m_slots[seq & m_mask];
+  // claim the slot, unless a broadcast a lap (or more) later already has
+  uint64_t tag = slot.tag.load();
+  while (true) {
+    if (tag == BUSY) {
+      sched_yield();
+      tag = slot.tag.load();
+    } else if (tag > seq + 1) {
+      return seq;
+    } else if (slot.tag.compare_exchange_weak(tag, BUSY)) {
+      break;
+    }
+  }
+  std::atomic_store(&slot.frame, frame);
+  slot.tag.store(seq + 1);
+  return seq;
+}
+
+void RoomHistory::restore(uint64_t seq, const FramePtr &frame) {
+  if (m_slots == nullptr || seq >= m_next.load())
+    return;
+  Slot &slot = m_slots[seq & m_mask];
+  if (slot.tag.load() > seq + 1) // the log held a later one first
+    return;
+  slot.frame = frame;
+  slot.tag.store(seq + 1);
+}
+
+size_t RoomHistory::replay(uint64_t first, uint64_t end, std::vector<FramePtr> &out) const {
+  if (m_slots == nullptr || first >= end)
+    return 0;
+  if (end - first > capacity()) // the older ones have been overwritten
+    first = end - capacity();
+  size_t count = 0;
+  for (uint64_t seq = first; seq < end; seq++) {
+    const Slot &slot = m_slots[seq & m_mask];
+    if (slot.tag.load() != seq + 1) // overwritten, or not written yet
+      continue;
+    FramePtr frame = std::atomic_load(&slot.frame);
+    if (slot.tag.load() != seq + 1) // overwritten while we read it
+      continue;
+    out.push_back(frame);
+    count++;
+  }
+  return count;
+}
@@ -0,0 +1,67 @@
+#ifndef ROOM_HISTORY_H
+#define ROOM_HISTORY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "message.h"
+
+// A room's most recent deliveries, kept so that a receiver joining (or
+// rejoining after a dropped connection) can catch up on what it missed.
+// Every delivery gets the next sequence number, and the history holds
+// the encoded frames of the last capacity() of them in a ring; a replay
+// hands out the same frames the room's members were sent, so catching
+// up copies nothing.
+//
+// Neither recording nor replaying takes the room's lock, or waits for
+// the other. A broadcast claims its sequence number with one atomic
+// increment and then its slot; a slot being rewritten is marked busy,
+// and a replay skips any slot whose sequence number isn't the one it
+// wants, before or after reading the frame. (The frame pointers are
+// swapped with std::atomic_store, as the room's member list is.) Two
+// broadcasts only ever wait for each other if they are a whole ring
+// apart and land on the same slot at once.
+class RoomHistory {
+public:
+  // capacity is rounded up to a power of two; 0 keeps nothing
+  explicit RoomHistory(size_t capacity);
+  ~RoomHistory();
+
+  size_t capacity() const { return m_slots == nullptr ? 0 : m_mask + 1; }
+
+  // record a delivery, returning its sequence number
+  uint64_t append(const FramePtr &frame);
+
+  // the sequence number of the next delivery
+  uint64_t next_sequence() const { return m_next.load(); }
+
+  // Used only while a new room restores its history from its log,
+  // before anyone has been handed the room: continue numbering from
+  // next, and put back a logged delivery.
+  void resume(uint64_t next) { m_next.store(next); }
+  void restore(uint64_t seq, const FramePtr &frame);
+
+  // Append to out, oldest first, the deliveries numbered from first up
+  // to (not including) end that are still held. Returns how many.
+  size_t replay(uint64_t first, uint64_t end, std::vector<FramePtr> &out) const;
+
+private:
+  // value semantics prohibited
+  RoomHistory(const RoomHistory &);
+  RoomHistory &operator=(const RoomHistory &);
+
+  // a slot's tag while its frame is being replaced
+  static const uint64_t BUSY = UINT64_MAX;
+
+  struct Slot {
+    std::atomic<uint64_t> tag; // sequence number + 1 of the frame, 0 if none yet
+    FramePtr frame; // read and replaced with std::atomic_load and std::atomic_store
+  };
+
+  Slot *m_slots;
+  size_t m_mask;
+  std::atomic<uint64_t> m_next;
+};
+
+#endif // ROOM_HISTORY_H
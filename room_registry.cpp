@@ -0,0 +1,77 @@
+#include "room_registry.h"
+#include "room.h"
+#include "guard.h"
+#include "message_log.h"
+
+RoomRegistry::RoomRegistry(size_t history_len, MessageLog *log)
+  : m_history_len(history_len), m_log(log) {
+  for (size_t i = 0; i < NUM_SHARDS; i++)
+    pthread_rwlock_init(&m_shards[i].lock, nullptr);
+}
+
+RoomRegistry::~RoomRegistry() {
+  for (size_t i = 0; i < NUM_SHARDS; i++) {
+    for (auto &entry : m_shards[i].rooms)
+      delete entry.second;
+    pthread_rwlock_destroy(&m_shards[i].lock);
+  }
+}
+
+RoomRegistry::Shard &RoomRegistry::shard_for(const std::string &room_name) {
+  return m_shards[std::hash<std::string>()(room_name) % NUM_SHARDS];
+}
+
+Room *RoomRegistry::acquire(const std::string &room_name) {
+  Room *room = find_or_create(room_name);
+  // A new room is published before its history is read from the log,
+  // so lookups of other rooms in the shard don't wait for the disk.
+  room->restore_history();
+  return room;
+}
+
+Room *RoomRegistry::find_or_create(const std::string &room_name) {
+  Shard &shard = shard_for(room_name);
+  {
+    // the common case: the room exists, so a shared lock will do
+    ReadGuard guard(shard.lock);
+    auto room = shard.rooms.find(room_name);
+    if (room != shard.rooms.end()) {
+      (*room).second->refs++;
+      return (*room).second;
+    }
+  }
+  WriteGuard guard(shard.lock);
+  Room *&room = shard.rooms[room_name]; // someone may have created it meanwhile
+  if (room == nullptr)
+    room = new Room(room_name, m_history_len, (m_log != nullptr) ? m_log->open_room_log(room_name) : nullptr);
+  room->refs++;
+  return room;
+}
+
+void RoomRegistry::release(Room *room) {
+  // Drop the reference without locking unless it may be the last one.
+  // References are only taken with the shard locked, so once the count
+  // reaches zero with the shard locked exclusively, nobody else can
+  // hold the room and it is safe to delete.
+  long refs = room->refs.load();
+  while (refs > 1) {
+    if (room->refs.compare_exchange_weak(refs, refs - 1))
+      return;
+  }
+  Shard &shard = shard_for(room->get_room_name());
+  WriteGuard guard(shard.lock);
+  if (room->refs.fetch_sub(1) == 1) {
+    shard.rooms.erase(room->get_room_name());
+    if (room->log != nullptr)
+      m_log->close_room_log(room->log);
+    delete room;
+  }
+}
+
+void RoomRegistry::for_each(const std::function<void(Room *)> &fn) {
+  for (size_t i = 0; i < NUM_SHARDS; i++) {
+    ReadGuard guard(m_shards[i].lock);
+    for (auto &entry : m_shards[i].rooms)
+      fn(entry.second);
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef ROOM_REGISTRY_H
+#define ROOM_REGISTRY_H
+
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <pthread.h>
+
+class Room;
+class MessageLog;
+
+// The server's set of rooms, looked up by name. Names are hashed to
+// one of a fixed number of shards, each with its own reader/writer
+// lock, so lookups of different rooms don't contend and lookups of the
+// same room only take the lock in shared mode.
+//
+// Rooms are reference counted: acquire returns a room that stays alive
+// until the matching release, and the room is deleted when the last
+// holder releases it, so rooms nobody is in don't accumulate.
+class RoomRegistry {
+public:
+  static const size_t NUM_SHARDS = 64;
+
+  // rooms keep their last history_len deliveries, and log them all if
+  // there is a log
+  RoomRegistry(size_t history_len = 0, MessageLog *log = nullptr);
+  ~RoomRegistry();
+
+  // Find the named room, creating it if needed, and take a reference to it.
+  Room *acquire(const std::string &room_name);
+
+  // Drop a reference taken by acquire; the room may be deleted.
+  void release(Room *room);
+
+  // Call fn on every room, with the room's shard locked for reading.
+  void for_each(const std::function<void(Room *)> &fn);
+
+private:
+  // value semantics prohibited
+  RoomRegistry(const RoomRegistry &);
+  RoomRegistry &operator=(const RoomRegistry &);
+
+  typedef std::unordered_map<std::string, Room *> RoomMap;
+
+  struct Shard {
+    pthread_rwlock_t lock;
+    RoomMap rooms;
+    char pad[64]; // keep neighbouring shards' locks off each other's cache lines
+  };
+
+  Shard &shard_for(const std::string &room_name);
+  // acquire, but the room's history may not have been restored yet
+  Room *find_or_create(const std::string &room_name);
+
+  size_t m_history_len;
+  MessageLog *m_log;
+  Shard m_shards[NUM_SHARDS];
+};
+
+#endif // ROOM_REGISTRY_H
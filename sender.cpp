@@ -2,18 +2,42 @@
 #include "connection.h"
 #include "csapp.h"
 #include "message.h"
+#include <deque>
 #include <iostream>
 #include <string>
 
 using std::cerr;
 using std::cin;
+using std::deque;
 using std::getline;
 using std::string;
 using std::stoi;
 
+// Receive the reply to the oldest request still in flight. The server
+// answers requests in the order they were sent, so replies are matched
+// to the sequence numbers of requests in order of arrival. Returns
+// false if the connection to the server was lost.
+static bool await_reply(Connection &connection, deque<long> &in_flight, bool show_seq) {
+  long seq = in_flight.front();
+  in_flight.pop_front();
+  Message response = Message();
+  if (!connection.receive(response) &&
+      connection.get_last_result() == Connection::EOF_OR_ERROR)
+    return false;
+  if (response.tag == TAG_ERR ||
+      connection.get_last_result() ==
+          Connection::INVALID_MSG) { // if an error occurs, output error data
+                                     // but continue looping
+    if (show_seq)
+      cerr << "request " << seq << ": ";
+    cerr << response.data;
+  }
+  return true;
+}
+
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    cerr << "Usage: ./sender [server_address] [port] [username]\n";
+  if (argc != 4 && argc != 5) {
+    cerr << "Usage: ./sender [server_address] [port] [username] [window]\n";
     return 1;
   }
 
@@ -21,6 +45,10 @@ int main(int argc, char **argv) {
   string server_hostname = argv[1];
   int server_port = stoi(argv[2]);
   string username = argv[3];
+  // how many requests may be waiting for their replies at once
+  size_t window = (argc == 5) ? stoi(argv[4]) : 1;
+  if (window < 1)
+    window = 1;
 
   // connect to the server
   Connection connection;
@@ -44,12 +72,15 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  // Loop indefinitely, read commands from user, send messages to server when
-  // needed
+  // Loop until the user quits (or input ends), read commands from
+  // user, send messages to server when needed
+  deque<long> in_flight; // sequence numbers of requests awaiting replies
+  long next_seq = 1;
   while (1) {
     string in;        // temp variable to hold each line of input
     Message msg;      // will eventually be the sent message
-    getline(cin, in); // get line of input from user
+    if (!getline(cin, in)) // get line of input from user
+      in = "/quit"; // no more input, so quit once every reply is in
 
     // check for the possible commands (start with /)
     // for both leave and quit, don't care about what comes after command tag
@@ -57,33 +88,33 @@ int main(int argc, char **argv) {
       msg.tag = TAG_LEAVE; // assign tag accordingly
     } else if (in == "/quit") {
       msg.tag = TAG_QUIT; // assign tag accordingly
-      connection.send(msg);
-      Message quit_resp = Message();
-      connection.receive(quit_resp); // receive response
-      // if error occurs, output error to cerr
-      if (quit_resp.tag == TAG_ERR ||
-          connection.get_last_result() == Connection::INVALID_MSG) {
-        cerr << quit_resp.data;
-      }
-      break; // but break out of loop regardless
     } else if (in.substr(0, 6) == "/join ") {
       msg.tag = TAG_JOIN;
       msg.data = in.substr(6); // grab the data that comes after tag
+    } else if (in.substr(0, 10) == "/senduser ") { // "/senduser bob hello"
+      string rest = in.substr(10);
+      size_t space = rest.find(' ');
+      msg.tag = TAG_SENDUSER;
+      msg.data = (space == string::npos) ? rest : rest.substr(0, space) + ":" + rest.substr(space + 1);
     } else { // if we get to here, then this is a sendall message
       msg.tag = TAG_SENDALL;
       msg.data = in;
     }
 
     connection.send(msg);
-    Message msg_response = Message();
-    connection.receive(msg_response); // receive response back
-    if (msg_response.tag == TAG_ERR ||
-        connection.get_last_result() ==
-            Connection::INVALID_MSG) { // if an error occurs, output error data
-                                       // but continue looping
-      cerr << msg_response.data;
+    in_flight.push_back(next_seq++);
+
+    if (msg.tag == TAG_QUIT) {
+      // wait for everything still in flight, ending with the reply to quit
+      while (!in_flight.empty() && await_reply(connection, in_flight, window > 1))
+        ;
+      break; // but break out of loop regardless
     }
+    // only wait once the window is full, so up to window requests are
+    // on their way to the server or back at any time
+    if (in_flight.size() >= window && !await_reply(connection, in_flight, window > 1))
+      break;
   }
   connection.close();
   return 0;
-}
\ No newline at end of file
+}
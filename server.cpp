@@ -1,254 +1,465 @@
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include "message.h"
 #include "connection.h"
 #include "user.h"
 #include "room.h"
-#include "guard.h"
+#include "session.h"
+#include "stats.h"
+#include "slab_pool.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "coro_executor.h"
+#include "worker_pool.h"
+#include "message_log.h"
 #include "server.h"
 
 using std::cerr;
 using std::string;
 
-////////////////////////////////////////////////////////////////////////
-// Server implementation data types
-////////////////////////////////////////////////////////////////////////
-
-// encapsulates a connection with a server that it belongs to
-struct Info
-{
-  Server *server;
-  Connection *connection;
-  ~Info()
-  {
-    delete connection;
-  }
-};
+// under the disconnect policy, seconds a write to a receiver may block
+// before the receiver is considered gone
+static const int SLOW_RECEIVER_TIMEOUT = 5;
 
 ////////////////////////////////////////////////////////////////////////
 // Client thread functions
 ////////////////////////////////////////////////////////////////////////
 // helper function for receiver to communicate with the server
-void r_chat(User *u, Server *s, Connection *c)
-{
-  Message msg = Message();
-  if (!(*c).receive(msg)) { // if message reception failed, will send appropriate error message and return
-    if ((*c).get_last_result() == Connection::INVALID_MSG) // case when a message was received but it was invalid
-      (*c).send(Message(TAG_ERR, "Invalid message received"));
-    else // case when no message was received
-      (*c).send(Message(TAG_ERR, "No message received"));
-    return;
-  }
+// (the session has already handled the receiver's join)
+void r_chat(Session &session, Server *s, Connection *c)
+{
+  User *u = session.get_user();
+  // sleep until either the receiver's queue has messages or its socket
+  // has something to say; a hang-up shows up here right away instead of
+  // on the next failed send
+  struct pollfd fds[2];
+  fds[0].fd = (*c).get_fd();
+  fds[0].events = POLLIN | POLLRDHUP;
+  fds[1].fd = (*u).mqueue.get_fd();
+  fds[1].events = POLLIN;
 
-  Room *rm = nullptr;
-  // if we get to here, the message was successfully received, so must handle the possible tags for a receiver
-  // the only tag that is acceptable (at the beginning) is the join tag
-  if (msg.tag == TAG_JOIN) {
-    rm = (*s).find_or_create_room(msg.data);  // find the room if it exists or create otherwise
-    (*rm).add_member(u); // add this receiver into the room
-    if (!(*c).send(Message(TAG_OK, "Successfully joined room")))
-      return; // return if confirmation of room join could not be sent
+  if ((*s).get_options().queue_limits.policy == MessageQueue::DISCONNECT) {
+    // a write to a receiver that has stopped reading would otherwise
+    // block this thread forever, and it would never see its queue close
+    struct timeval tv;
+    tv.tv_sec = SLOW_RECEIVER_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt((*c).get_fd(), SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
   }
-  else // if the tag is not a join, then receiver is not able to join a room
-    (*c).send(Message(TAG_ERR, "Invalid message as receiver has not joined a room"));
 
-  // loop indefinitely relaying messages to the receiver now that it is in a room
-  while (true) {
-    Message *message = (*u).mqueue.dequeue(); // grab the first message from the message queue
-    
-    // if a message was successfully dequeued, then handle it
-    // need this case because dequeue might not return a message every time
-    if (message != nullptr) { 
-      // attempt to send the message to the receiver
-      if (!(*c).send(*message)) { // if it fails, then break out and can return
-        delete message;
-        break;
-      }
-      delete message; // delete the message regardless
+  // loop relaying messages to the receiver until it can't be reached
+  while (!session.is_done()) {
+    fds[0].revents = fds[1].revents = 0;
+    // a polling receiver's queue stays readable until it asks, so
+    // only its socket can wake us
+    fds[1].fd = session.is_polling() ? -1 : (*u).mqueue.get_fd();
+    if (!(*c).has_buffered_input() && poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
     }
+    if ((*c).has_buffered_input() || fds[0].revents != 0) {
+      Message msg;
+      if (!(*c).receive(msg)) // the receiver hung up
+        session.handle_receive_error();
+      else
+        session.handle_message(msg);
+    }
+    // relay everything that is queued for the receiver
+    session.deliver_queued();
   }
-  (*rm).remove_member(u); // before returning, make sure to remove the receiver from the room it was in
+  session.leave_room(); // before returning, make sure to remove the receiver from the room it was in
 }
 
 // helper function for sender to communicate with the server
-void s_chat(User *u, Server *s, Connection *c)
+void s_chat(Session &session, Connection *c)
 {
-  Room *rm = nullptr; // local variable that will store which room this sender is a part of
-  // loop infinitely until the sender quits or leaves the room
-  while (true) {
-    Message msg;
-    if (!(*c).receive(msg)) { // if message reception failed
-      // case when a message was received but it was invalid, so have to return
-      if ((*c).get_last_result() == Connection::EOF_OR_ERROR || (*c).get_last_result() == Connection::INVALID_MSG) {
-        (*c).send(Message(TAG_ERR, "Invalid message received"));
-        return;
-      }
-      // case when no message was received, so can continue
-      else
-        (*c).send(Message(TAG_ERR, "No message received"));
-    }
-    else { // the message was successfully received, so need to handle based on its tag
-      if (msg.tag == TAG_ERR) { // if an error message was received, need to return right away
-        cerr << msg.data;
-        return;
-      }
-      else if (msg.data.length() == Message::MAX_LEN) // case where the message received was too long
-        (*c).send(Message(TAG_ERR, "Message is too long"));
+  // A sender may pipeline requests without waiting for each reply.
+  // The replies to everything that arrived together are held back and
+  // written at once when receive runs out of buffered requests.
+  (*c).cork();
 
-      else if (msg.tag == TAG_QUIT) { // case where the sender wants to quit
-        (*c).send(Message(TAG_OK, "Quitting now"));
-        return;
-      }
-      else if (rm == nullptr) { // if the sender is not in a room, then they need to join one to send any message
-        // nullptr for rm would indicate that the user is not in a room
-        if (msg.tag != TAG_JOIN) // that means if this message wasn't a join request, they have violated the use rules
-          (*c).send(Message(TAG_ERR, "Not a member of a room, so can't send message"));
-        else { // the user did try to join a room, so we add them to that room
-          rm = (*s).find_or_create_room(msg.data); // find the room if it exists or create otherwise
-          (*rm).add_member(u); // add this sender into the room
-          if (!(*c).send(Message(TAG_OK, "Successfully joined room")))
-            return; // return if confirmation of room join could not be sent
-        }
-      }
-      else if (msg.tag == TAG_SENDALL) { // case where sender wants to send a message to everyone in the room
-        (*rm).broadcast_message((*u).username, msg.data); // send the message first using broadcast
-        if (!(*c).send(Message(TAG_OK, "Message broadcasted in room")))
-          return; // return if confirmation of message send could not be sent
-      }
-      else if (msg.tag == TAG_LEAVE) { // case where the sender wants to leave their room (not quit though)
-        if (rm == nullptr) // if the user wants to leave a room, but aren't actually in a room
-          (*c).send(Message(TAG_ERR, "Sender not in a room!"));
-        else { // the sender is in a room, so can leave from there
-          (*rm).remove_member(u); // remove the sender from the room
-          rm = nullptr; // sender now no longer has a room
-          if (!(*c).send(Message(TAG_OK, "Successfully left room")))
-            return;  // return if confirmation of leaving could not be sent
-        }
-      }
-      else if (msg.tag == TAG_JOIN) { // case where sender wants to join a room, but they're already in a different room
-        (*rm).remove_member(u); // first remove them from their prior room
-        rm = (*s).find_or_create_room(msg.data); // find the room if it exists or create otherwise
-        (*rm).add_member(u); // add this sender into the room
-        if (!(*c).send(Message(TAG_OK, "Successfully joined new room")))
-          return;  // return if confirmation of room join could not be sent
-      }      
-      else { // if we get to here, then the tag was not valid
-        if (!(*c).send(Message(TAG_ERR, "Invalid message tag"))) // send message that tag was invalid
-          return; // return if confirmation of invalid tag couldn't be sent
-      }
-    }
+  // loop until the sender quits or the connection fails
+  Message msg;
+  while (session.get_state() == Session::SENDER) {
+    if (!(*c).receive(msg)) // if message reception failed
+      session.handle_receive_error();
+    else // the message was successfully received, so the session handles it based on its tag
+      session.handle_message(msg);
   }
-  // when this chat between sender and server ends, delete the user and connection
-  // don't delete the server because it could still be communicating with other users
-  delete c;
-  delete u;
+  (*c).uncork(); // e.g. the reply to quit
 }
 
 namespace
 {
-  void *worker(void *arg) {
-    pthread_detach(pthread_self());
-    // use a static cast to convert arg from a void* to Info object that holds connection and server
-    struct Info *_info = (Info *)arg; 
-    std::unique_ptr<Info> info(_info);
-
-    Message login = Message();
-
-    // if unable to receive the login message, handle the two possible cases
-    if (!(*info).connection->receive(login)) {
-      // invalid message
-      if ((*info).connection->get_last_result() == Connection::INVALID_MSG)
-        (*info).connection->send(Message(TAG_ERR, "Invalid message received"));
-      // didn't receive a message
-      else
-        (*info).connection->send(Message(TAG_ERR, "No message received"));
-      return nullptr;
+  // open a listening socket on port, like open_listenfd but with the
+  // given backlog and, if reuse_port is set, SO_REUSEPORT so that
+  // several sockets can share the port
+  int open_listener(int port, int backlog, bool reuse_port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;             // accept connections
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG; // on any IP address
+    hints.ai_flags |= AI_NUMERICSERV;            // using port number
+    int rc = getaddrinfo(NULL, std::to_string(port).c_str(), &hints, &listp);
+    if (rc != 0) {
+      cerr << "getaddrinfo failed (port " << port << "): " << gai_strerror(rc) << "\n";
+      return -1;
     }
-
-    // if the user sends a FIRST message that isn't a login message (sender or receiver)
-    if (!(login.tag == TAG_RLOGIN || login.tag == TAG_SLOGIN)) {
-      (*info).connection->send(Message(TAG_ERR, "Sender/Receiver must first log in"));  // send message that user did not login
-      return nullptr;
+    // walk the list for one that we can bind to
+    for (p = listp; p; p = p->ai_next) {
+      listenfd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+      if (listenfd < 0)
+        continue;
+      setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+      if (reuse_port)
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+      if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+        break;
+      close(listenfd);
+      listenfd = -1;
+    }
+    freeaddrinfo(listp);
+    if (listenfd >= 0 && ::listen(listenfd, backlog) < 0) {
+      close(listenfd);
+      listenfd = -1;
     }
-    // a login message was sent, so can log the user in
-    else {
-      if (!(*info).connection->send(Message(TAG_OK, "Logged in as: " + login.data)))  // send message that user logged in
-        return nullptr; // if the confirmation fails, return
+    return listenfd;
+  }
+
+  // keep the calling thread on one CPU, chosen by index
+  void pin_to_cpu(size_t index) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus < 1)
+      return;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % num_cpus, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+      cerr << "Failed to pin acceptor " << index << " to a CPU\n";
+  }
+
+  // periodically report the server's statistics on stderr
+  void *stats_reporter(void *arg) {
+    pthread_detach(pthread_self());
+    Server *server = (Server *)arg;
+    while (true) {
+      sleep((*server).get_options().stats_interval);
+      (*server).report_stats(cerr);
     }
-    // store the username and create the user since the login was valid
-    string username = login.data;
-    User *user = new User(login.data);
-
-    // Facilitate communication between the user and the server
-
-    // if user is a receiver, then use r_chat helper function
-    if (login.tag == TAG_RLOGIN)
-      r_chat(user, (*info).server, (*info).connection);
-    // if user is a sender, then user s_chat helper function
-    else
-      s_chat(user, (*info).server, (*info).connection);
     return nullptr;
   }
+
+  // serve one client on a worker thread, from login until it leaves
+  void serve_client(void *arg, int fd) {
+    Server *server = (Server *)arg;
+    {
+      Connection conn(fd);
+      Connection *c = &conn;
+      Session session(server, c);
+
+      // handle the login (and a receiver's join) one message at a time
+      while (session.get_state() == Session::LOGIN || session.get_state() == Session::RECEIVER_JOIN) {
+        Message msg = Message();
+        if (!c->receive(msg))
+          session.handle_receive_error();
+        else
+          session.handle_message(msg);
+      }
+
+      // Facilitate communication between the user and the server
+
+      // if user is a receiver, then use r_chat helper function
+      if (session.get_state() == Session::RECEIVER)
+        r_chat(session, server, c);
+      // if user is a sender, then user s_chat helper function
+      else if (session.get_state() == Session::SENDER)
+        s_chat(session, c);
+    } // the session leaves its room, then the connection closes
+    (*server).connection_closed();
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////
 // Server member function implementation
 ////////////////////////////////////////////////////////////////////////
 
-Server::Server(int port)
-    : m_port(port), m_ssock(-1)
+Server::Server(int port, const ServerOptions &options)
+    : m_port(port), m_options(options)
+    , m_log(options.log_dir.empty() ? nullptr : new MessageLog(options.log_dir, options.log_sync_ms))
+    , m_rooms(options.history_len, m_log), m_pool(nullptr)
+    , m_num_connections(0)
 {
-  pthread_mutex_init(&m_lock, nullptr); // initialize mutex
 }
 
 Server::~Server()
 {
-  pthread_mutex_destroy(&m_lock); // destroy mutex
+  for (auto loop : m_loops)
+    delete loop;
+  for (auto loop : m_uring_loops)
+    delete loop;
+  for (auto executor : m_executors)
+    delete executor;
+  delete m_pool;
+  for (int fd : m_listeners)
+    close(fd);
+  delete m_log; // writes out what is still buffered
 }
 
 bool Server::listen()
 {
-  m_ssock = open_listenfd(std::to_string(m_port).c_str()); // attempt to open the socket
-  if (m_ssock < 0) { // if failed, then return false
-    cerr << "Server socket not opened";
+  // recover the rooms' logs before any client can add to them
+  if (m_log != nullptr && !m_log->open())
     return false;
+
+  // With several listeners, each is a separate SO_REUSEPORT socket on
+  // the same port, and the kernel spreads incoming connections over them.
+  int count = m_options.num_listeners;
+  for (int i = 0; i < count; i++) {
+    int fd = open_listener(m_port, m_options.backlog, count > 1); // attempt to open the socket
+    if (fd < 0) { // if failed, then return false
+      cerr << "Server socket not opened";
+      return false;
+    }
+    m_listeners.push_back(fd);
   }
-  return true; // socket successfully opened, so return true
+  return true; // sockets successfully opened, so return true
 }
 
 void Server::handle_client_requests()
-{ 
-  // infinite loop accepting new clients, connecting with the clients and starting new threads for each
+{
+  if (m_options.stats_interval > 0) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stats_reporter, this) != 0)
+      cerr << "Failed to create statistics thread";
+  }
+  if (m_options.mode == ServerOptions::URING && !UringLoop::supported()) {
+    cerr << "io_uring is not available, falling back to epoll\n";
+    m_options.mode = ServerOptions::EPOLL;
+  }
+  bool started;
+  switch (m_options.mode) {
+  case ServerOptions::EPOLL:
+    started = start_event_loops();
+    break;
+  case ServerOptions::URING:
+    started = start_uring_loops();
+    break;
+  case ServerOptions::COROUTINES:
+    started = start_executors();
+    break;
+  default:
+    started = start_worker_pool();
+    break;
+  }
+  if (!started)
+    return;
+
+  // one acceptor per listening socket, the first on this thread
+  for (size_t i = 1; i < m_listeners.size(); i++) {
+    AcceptorInfo *info = new AcceptorInfo();
+    (*info).server = this;
+    (*info).index = i;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, acceptor, info) != 0) {
+      cerr << "Failed to create acceptor thread\n";
+      delete info;
+      close(m_listeners[i]); // don't let the kernel queue clients nobody accepts
+    }
+  }
+  accept_clients(0);
+}
+
+bool Server::start_worker_pool()
+{
+  // each client gets a thread of its own, unless a fixed pool of
+  // workers (-w) is to serve them, so that a burst of connections
+  // can't exhaust the server's threads or memory
+  m_pool = new WorkerPool(serve_client, this, m_options.num_workers,
+                          m_options.accept_queue, m_options.stack_size);
+  if (!(*m_pool).start()) {
+    cerr << "Failed to create any worker threads";
+    return false;
+  }
+  return true;
+}
+
+bool Server::start_event_loops()
+{
+  // start the event loops; the acceptors spread clients across them
+  for (int i = 0; i < m_options.num_loops; i++) {
+    EventLoop *loop = new EventLoop(this);
+    m_loops.push_back(loop);
+    if (!(*loop).start())
+      return false;
+  }
+  return true;
+}
+
+bool Server::start_uring_loops()
+{
+  for (int i = 0; i < m_options.num_loops; i++) {
+    UringLoop *loop = new UringLoop(this);
+    m_uring_loops.push_back(loop);
+    if (!(*loop).start())
+      return false;
+  }
+  return true;
+}
+
+bool Server::start_executors()
+{
+  for (int i = 0; i < m_options.num_loops; i++) {
+    CoroExecutor *executor = new CoroExecutor(this);
+    m_executors.push_back(executor);
+    if (!(*executor).start())
+      return false;
+  }
+  return true;
+}
+
+void *Server::acceptor(void *arg)
+{
+  pthread_detach(pthread_self());
+  std::unique_ptr<AcceptorInfo> info((AcceptorInfo *)arg);
+  (*(*info).server).accept_clients((*info).index);
+  return nullptr;
+}
+
+// infinite loop accepting new clients on one listening socket and
+// handing each to the worker pool or an event loop
+void Server::accept_clients(size_t index)
+{
+  if (m_options.pin_acceptors)
+    pin_to_cpu(index);
+  int listener = m_listeners[index];
+  // event loop sockets are non-blocking from the start; a worker's
+  // connection stays blocking, and so does an io_uring loop's (the
+  // ring itself never blocks on them)
+  int flags = SOCK_CLOEXEC;
+  if (m_options.mode == ServerOptions::EPOLL || m_options.mode == ServerOptions::COROUTINES)
+    flags |= SOCK_NONBLOCK;
+  size_t next = index; // acceptors start their round robin at different loops
   while (true) {
-    int client = accept(m_ssock, nullptr, nullptr);
-    // if the client's file descriptor is negative, the connection failed
-    if (client < 0) {
-      cerr << "Unable to accept client connection";
-      return;
+    int client = accept_client(listener, flags);
+    if (client < 0)
+      break;
+    if (!admit(client))
+      continue;
+    if (m_options.mode == ServerOptions::EPOLL) {
+      m_loops[next % m_loops.size()]->add_connection(client);
+      next++;
+    } else if (m_options.mode == ServerOptions::URING) {
+      m_uring_loops[next % m_uring_loops.size()]->add_connection(client);
+      next++;
+    } else if (m_options.mode == ServerOptions::COROUTINES) {
+      m_executors[next % m_executors.size()]->add_connection(client);
+      next++;
+    } else if (!(*m_pool).submit(client)) { // every worker is busy and the queue is full (or no thread)
+      reject(client);
+      connection_closed();
     }
-    //otherwise, the connection was successful, so create info for the client
-    struct Info *info = new Info();
-    (*info).server = this;
-    (*info).connection = new Connection(client);
+  }
+  close(listener);
+}
 
-    // connection was successful, so also create a new thread for the client
-    pthread_t thread;
-    if (pthread_create(&thread, NULL, worker, info) != 0) { // if creating the thread fails, then return
-      cerr << "Failed to create thread";
-      return;
+// Accept the next client, riding out failures that only affect one
+// connection or pass with time (such as running out of descriptors).
+// Returns -1 only if the listening socket itself is unusable.
+int Server::accept_client(int listener, int flags)
+{
+  while (true) {
+    int client = accept4(listener, nullptr, nullptr, flags);
+    if (client >= 0)
+      return client;
+    switch (errno) {
+    case EINTR:
+    case ECONNABORTED:
+    case EPROTO:
+      break;
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+      cerr << "Unable to accept client connection, retrying\n";
+      usleep(10000); // give connections a chance to close
+      break;
+    default:
+      cerr << "Unable to accept client connection";
+      return -1;
     }
   }
 }
 
-Room *Server::find_or_create_room(const std::string &room_name)
+// count a new client against the connection limit, turning it away
+// if the server is already full
+bool Server::admit(int fd)
 {
-  Guard guard(m_lock); // ensure synchronization
-  auto room = m_rooms.find(room_name); // try to find the room with given room_name
-  // if the room wasn't found, then need to create it
-  if (room == m_rooms.end()) {
-    m_rooms[room_name] = new Room(room_name); // create and add the new room to the existing list for the server
-    return m_rooms[room_name];
+  int limit = m_options.max_connections;
+  if (m_num_connections.fetch_add(1) >= limit && limit > 0) {
+    m_num_connections.fetch_sub(1);
+    reject(fd);
+    return false;
   }
-  return (*room).second; // if the room was found, can just return it
-}
\ No newline at end of file
+  return true;
+}
+
+void Server::reject(int fd)
+{
+  g_stats.record_rejection();
+  Connection conn(fd); // closes the socket once the reply is written
+  conn.set_nonblocking(); // a client that isn't reading can't hold up accepting
+  conn.send(TAG_ERR, "Server is busy, try again later");
+}
+
+void Server::connection_closed()
+{
+  m_num_connections.fetch_sub(1);
+}
+
+Room *Server::find_or_create_room(const std::string &room_name)
+{
+  return m_rooms.acquire(room_name);
+}
+
+void Server::release_room(Room *room)
+{
+  m_rooms.release(room);
+}
+
+void Server::add_receiver(const std::shared_ptr<User> &user)
+{
+  m_receivers.add(user);
+}
+
+void Server::remove_receiver(const std::shared_ptr<User> &user)
+{
+  m_receivers.remove(user);
+}
+
+UserIndex::UserListPtr Server::find_receivers(const std::string &username)
+{
+  return m_receivers.find(username);
+}
+
+void Server::report_stats(std::ostream &out)
+{
+  size_t num_rooms = 0;
+  m_rooms.for_each([&out, &num_rooms](Room *room) {
+    (*room).report(out);
+    num_rooms++;
+  });
+  out << num_rooms << " rooms, " << m_num_connections.load() << " connections\n";
+  g_stats.report(out);
+  SlabPool::report_all(out);
+  if (m_log != nullptr)
+    m_log->report(out);
+}
@@ -1,32 +1,110 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include <map>
+#include <vector>
 #include <string>
+#include <ostream>
+#include <atomic>
 #include <pthread.h>
 #include "connection.h"
 #include "user.h"
+#include "room_registry.h"
+#include "user_index.h"
 class Room;
+class EventLoop;
+class UringLoop;
+class CoroExecutor;
+class WorkerPool;
+class MessageLog;
+
+// settings chosen on the server's command line
+struct ServerOptions {
+  // how client connections are serviced
+  enum Mode {
+    THREADED, // one blocking thread per client connection
+    EPOLL,    // a few event loop threads multiplexing non-blocking sockets
+    URING,    // like EPOLL, but the loops do their I/O through io_uring
+              // (EPOLL is used instead if the kernel doesn't support it)
+    COROUTINES, // a few executor threads running a coroutine per client
+  };
+
+  Mode mode;
+  int num_loops; // number of event loop (or executor) threads in EPOLL, URING and COROUTINES mode
+  int num_workers; // number of worker threads in THREADED mode, 0 for a thread per client
+  int accept_queue; // connections that may wait for a busy worker
+  int max_connections; // clients served at once, 0 for no limit
+  size_t stack_size; // worker thread stack size in bytes, 0 for the default
+  int num_listeners; // SO_REUSEPORT listening sockets, each with its own acceptor
+  bool pin_acceptors; // keep each acceptor thread on its own CPU
+  int backlog; // listen backlog of each listening socket
+  MessageQueue::Limits queue_limits; // bound on each receiver's queue
+  int stats_interval; // seconds between statistics reports, 0 for none
+  size_t max_payload; // longest data accepted in a protocol version 2 frame
+  size_t history_len; // deliveries each room keeps for replay, 0 for none
+  std::string log_dir; // where rooms' deliveries are logged, empty for no log
+  int log_sync_ms; // most time between a delivery and the log's fsync
+
+  ServerOptions()
+    : mode(THREADED), num_loops(4), num_workers(0), accept_queue(64)
+    , max_connections(0), stack_size(0), num_listeners(1), pin_acceptors(false)
+    , backlog(1024), stats_interval(0)
+    , max_payload(Connection::DEFAULT_MAX_PAYLOAD), history_len(256)
+    , log_sync_ms(10) { }
+};
+
 class Server {
 public:
-  Server(int port);
+  Server(int port, const ServerOptions &options = ServerOptions());
   ~Server();
   bool listen();
   void handle_client_requests();
+  // Find or create a room and hold on to it; every room returned must
+  // eventually be passed to release_room, which deletes it once nobody
+  // holds it any more.
   Room *find_or_create_room(const std::string &room_name);
-  void r_chat(User *u, Server *s, Connection *c);
-  void s_chat(User *u, Server *s, Connection *c);
+  void release_room(Room *room);
+  // Receivers are indexed by name from joining a room until they
+  // leave, so that direct messages can find them.
+  void add_receiver(const std::shared_ptr<User> &user);
+  void remove_receiver(const std::shared_ptr<User> &user);
+  UserIndex::UserListPtr find_receivers(const std::string &username);
+  const ServerOptions &get_options() const { return m_options; }
+  // write per-room and per-user drop counters to out
+  void report_stats(std::ostream &out);
+  // called once a client connection admitted by the server has closed
+  void connection_closed();
 private:
   // prohibit value semantics
   Server(const Server &);
   Server &operator=(const Server &);
-  typedef std::map<std::string, Room *> RoomMap;
+  // what an acceptor thread needs to know
+  struct AcceptorInfo {
+    Server *server;
+    size_t index; // which listening socket to accept on
+  };
+
+  bool start_worker_pool();
+  bool start_event_loops();
+  bool start_uring_loops();
+  bool start_executors();
+  static void *acceptor(void *arg);
+  void accept_clients(size_t index);
+  int accept_client(int listener, int flags);
+  bool admit(int fd);
+  void reject(int fd);
   // These member variables are sufficient for implementing
   // the server operations
   int m_port;
-  int m_ssock;
-  RoomMap m_rooms;
-  pthread_mutex_t m_lock;
+  std::vector<int> m_listeners;
+  ServerOptions m_options;
+  MessageLog *m_log; // (before m_rooms, which uses it)
+  RoomRegistry m_rooms;
+  UserIndex m_receivers;
+  std::vector<EventLoop *> m_loops;
+  std::vector<UringLoop *> m_uring_loops;
+  std::vector<CoroExecutor *> m_executors;
+  WorkerPool *m_pool;
+  std::atomic<int> m_num_connections;
 };
 
-#endif // SERVER_H
\ No newline at end of file
+#endif // SERVER_H
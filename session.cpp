@@ -0,0 +1,401 @@
+#include <cstdlib>
+#include <cctype>
+#include <iostream>
+#include "message.h"
+#include "user.h"
+#include "room.h"
+#include "room_history.h"
+#include "server.h"
+#include "stats.h"
+#include "session.h"
+#include "slab_pool.h"
+
+using std::cerr;
+using std::string;
+
+namespace {
+  struct UserPool { static const char *name() { return "users"; } };
+  typedef PoolAllocator<User, UserPool> UserAllocator;
+}
+
+Session::Session(Server *server, Connection *conn)
+  : m_server(server)
+  , m_conn(conn)
+  , m_state(LOGIN)
+  , m_room(nullptr)
+  , m_indexed(false)
+  , m_polling(false), m_greeted(false) {
+}
+
+Session::~Session() {
+  leave_room(); // a receiver must not be left in its room's member set
+}
+
+void Session::handle_message(const Message &msg) {
+  switch (m_state) {
+  case LOGIN:
+    handle_login(msg);
+    break;
+  case RECEIVER_JOIN:
+    handle_receiver_join(msg);
+    break;
+  case SENDER:
+    handle_sender(msg);
+    break;
+  case RECEIVER:
+    handle_receiver(msg);
+    break;
+  case DONE:
+    break;
+  }
+}
+
+bool Session::handle_buffered_input() {
+  bool joined = false;
+  while (!is_done() && m_conn->next_message(m_input)) {
+    if (m_conn->get_last_result() != Connection::SUCCESS) { // a malformed message
+      handle_receive_error();
+      continue;
+    }
+    State before = m_state;
+    handle_message(m_input);
+    if (before != RECEIVER && m_state == RECEIVER)
+      joined = true;
+  }
+  return joined;
+}
+
+void Session::handle_receive_error() {
+  if (m_conn->get_last_result() == Connection::INVALID_MSG) {
+    // the malformed line has been skipped, so a sender can carry on,
+    // and a receiver's input is ignored anyway
+    if (m_state == SENDER) {
+      switch (m_conn->get_last_error()) {
+      case Connection::LINE_TOO_LONG:
+        reply(TAG_ERR, "Message is too long");
+        break;
+      case Connection::MISSING_COLON:
+        reply(TAG_ERR, "Message has no ':' after its tag");
+        break;
+      case Connection::UNKNOWN_TAG:
+        reply(TAG_ERR, "Invalid message tag");
+        break;
+      default:
+        reply(TAG_ERR, "Invalid message received");
+        break;
+      }
+      return;
+    }
+    if (m_state == RECEIVER)
+      return;
+  }
+  if (m_state == LOGIN || m_state == RECEIVER_JOIN) {
+    // case when a message was received but it was invalid
+    if (m_conn->get_last_result() == Connection::INVALID_MSG)
+      m_conn->send(TAG_ERR, "Invalid message received");
+    else // case when no message was received
+      m_conn->send(TAG_ERR, "No message received");
+  } else if (m_state == SENDER) {
+    m_conn->send(TAG_ERR, "Invalid message received");
+  }
+  m_state = DONE;
+}
+
+void Session::deliver(const Frame &frame) {
+  // attempt to send the message to the receiver, which is gone if it fails
+  if (!m_conn->send(frame))
+    m_state = DONE;
+}
+
+void Session::deliver_queued(size_t output_limit) {
+  MessageQueue &mqueue = m_user->mqueue;
+  // a polling receiver asks for its deliveries instead
+  while (!m_polling && !is_done() && m_conn->pending_output() < output_limit) {
+    m_batch.clear();
+    if (mqueue.dequeue_batch(m_batch, MAX_BATCH_FRAMES, MAX_BATCH_BYTES) == 0)
+      break;
+    g_stats.record_batch(m_batch.size());
+    if (!m_conn->send(m_batch)) // the receiver is gone
+      m_state = DONE;
+  }
+  m_batch.clear(); // don't hold on to delivered frames
+  disconnect_if_closed();
+}
+
+// true (and the session is over) if the receiver's queue was closed
+// for falling too far behind
+bool Session::disconnect_if_closed() {
+  MessageQueue &mqueue = m_user->mqueue;
+  if (is_done() || !mqueue.is_closed())
+    return false;
+  cerr << "Disconnecting slow receiver " << m_user->username << " after "
+       << mqueue.get_dropped() << " dropped messages\n";
+  m_conn->send(TAG_ERR, "Receiver too slow, disconnecting");
+  m_state = DONE;
+  return true;
+}
+
+// Once it has joined its first room, a receiver may join more rooms
+// (join:room), leave one (leave:room) or all of them (leave:), and poll
+// for deliveries. Anything else is ignored.
+void Session::handle_receiver(const Message &msg) {
+  if (msg.tag == TAG_POLL)
+    handle_poll(msg);
+  else if (msg.tag == TAG_JOIN)
+    subscribe(msg.data);
+  else if (msg.tag == TAG_LEAVE)
+    unsubscribe(msg.data);
+}
+
+// poll:N switches a receiver from having deliveries pushed to asking for
+// them: it gets up to N queued deliveries followed by "ok:<number
+// delivered>", all in one write, or "empty" at once if nothing is queued
+void Session::handle_poll(const Message &msg) {
+  char *end;
+  unsigned long max_frames = strtoul(msg.data.c_str(), &end, 10);
+  if (msg.data.empty() || *end != '\0' || max_frames == 0) {
+    reply(TAG_ERR, "Invalid poll request, expected poll:N"); // deliveries are still pushed
+    return;
+  }
+  m_polling = true;
+  if (disconnect_if_closed())
+    return;
+  m_batch.clear();
+  if (max_frames > MAX_BATCH_FRAMES)
+    max_frames = MAX_BATCH_FRAMES;
+  size_t n = m_user->mqueue.dequeue_batch(m_batch, max_frames, MAX_BATCH_BYTES);
+  if (n == 0) {
+    reply(TAG_EMPTY, "No messages available");
+    return;
+  }
+  g_stats.record_batch(n);
+  m_batch.push_back(std::make_shared<const Frame>(TAG_OK, std::to_string(n)));
+  if (!m_conn->send(m_batch)) // the receiver is gone
+    m_state = DONE;
+  m_batch.clear();
+}
+
+// the first message must log the client in as a sender or receiver
+void Session::handle_login(const Message &msg) {
+  bool first = !m_greeted;
+  m_greeted = true;
+  if (msg.tag == TAG_PROTO && !first) { // the version can't change mid-handshake
+    m_conn->send(TAG_ERR, "Protocol version may only be chosen in the first message");
+    m_state = DONE;
+    return;
+  }
+  if (msg.tag == TAG_PROTO) { // the client may pick a protocol version first
+    if (msg.data == "2") {
+      reply(TAG_OK, "Using protocol 2"); // the reply itself is still text
+      m_conn->set_protocol(2, m_server->get_options().max_payload);
+    } else if (msg.data == "1") {
+      reply(TAG_OK, "Using protocol 1");
+    } else {
+      reply(TAG_ERR, "Unsupported protocol version");
+    }
+    return;
+  }
+  if (!(msg.tag == TAG_RLOGIN || msg.tag == TAG_SLOGIN)) {
+    m_conn->send(TAG_ERR, "Sender/Receiver must first log in");
+    m_state = DONE;
+    return;
+  }
+  // a login message was sent, so can log the user in
+  m_user = std::allocate_shared<User>(UserAllocator(), msg.data, m_server->get_options().queue_limits);
+  m_state = (msg.tag == TAG_RLOGIN) ? RECEIVER_JOIN : SENDER;
+  reply(TAG_OK, "Logged in as: " + msg.data);
+}
+
+// the only tag that is acceptable from a receiver is the join tag
+void Session::handle_receiver_join(const Message &msg) {
+  if (msg.tag != TAG_JOIN) {
+    m_conn->send(TAG_ERR, "Invalid message as receiver has not joined a room");
+    m_state = DONE;
+    return;
+  }
+  m_server->add_receiver(m_user); // let direct messages find it
+  m_indexed = true;
+  m_state = RECEIVER;
+  subscribe(msg.data);
+}
+
+// Add a receiver to a room. Deliveries from all of a receiver's rooms
+// go through its one queue, each naming the room it came from.
+//
+// "room:last:K" or "room:since:N" also replays the room's last K
+// deliveries, or those from sequence number N on, that its history
+// still holds (see replay). Room names may contain colons themselves,
+// so only such a suffix is taken off; anything else is all room name.
+void Session::subscribe(const string &request) {
+  string room_name = request;
+  bool replaying = false, since = false;
+  uint64_t count = 0;
+  size_t number = request.rfind(':'), how = string::npos;
+  if (number != string::npos && number > 0)
+    how = request.rfind(':', number - 1);
+  if (how != string::npos && how > 0) {
+    string kind = request.substr(how + 1, number - how - 1);
+    const char *digits = request.c_str() + number + 1;
+    char *end;
+    uint64_t n = strtoull(digits, &end, 10);
+    if ((kind == "last" || kind == "since") && isdigit((unsigned char) *digits) && *end == '\0') {
+      room_name = request.substr(0, how);
+      replaying = true;
+      since = kind == "since";
+      count = n;
+    }
+  }
+  for (Room *room : m_subscriptions) {
+    if (room->get_room_name() == room_name) {
+      reply(TAG_ERR, "Already joined room " + room_name);
+      return;
+    }
+  }
+  Room *room = m_server->find_or_create_room(room_name); // find the room if it exists or create otherwise
+  room->add_member(m_user); // add this receiver into the room
+  m_subscriptions.push_back(room);
+  if (!replaying)
+    reply(TAG_OK, "Successfully joined room");
+  else
+    replay(room, since, count);
+}
+
+// Send the receiver a room's past deliveries from its history, straight
+// from the history's frames, followed by "ok:Replayed R messages, next
+// sequence S": resuming from S later picks up where this left off (S
+// plus the number of the room's deliveries received since).
+//
+// The receiver is already a member, so nothing broadcast from here on
+// is missed; a delivery broadcast as it joined may arrive twice.
+void Session::replay(Room *room, bool since, uint64_t count) {
+  const RoomHistory &history = room->get_history();
+  uint64_t end = history.next_sequence();
+  uint64_t first = since ? count : (count < end ? end - count : 0);
+  m_batch.clear();
+  history.replay(first, end, m_batch);
+  // as in a broadcast, leave out the receiver's own messages
+  string own = room->delivery_prefix(m_user->username);
+  size_t kept = 0;
+  for (auto &frame : m_batch)
+    if (frame->data_size() < own.size() || own.compare(0, own.size(), frame->data(), own.size()) != 0)
+      m_batch[kept++] = frame;
+  m_batch.resize(kept);
+  m_batch.push_back(std::make_shared<const Frame>(TAG_OK,
+      "Replayed " + std::to_string(kept) + " messages, next sequence " + std::to_string(end)));
+  if (!m_conn->send(m_batch)) // the receiver is gone
+    m_state = DONE;
+  m_batch.clear();
+}
+
+// remove a receiver from the named room, or from every room if the name is empty
+void Session::unsubscribe(const string &room_name) {
+  for (size_t i = 0; i < m_subscriptions.size(); ) {
+    Room *room = m_subscriptions[i];
+    if (!room_name.empty() && room->get_room_name() != room_name) {
+      i++;
+      continue;
+    }
+    room->remove_member(m_user);
+    m_server->release_room(room);
+    m_subscriptions.erase(m_subscriptions.begin() + i);
+    if (!room_name.empty()) {
+      reply(TAG_OK, "Successfully left room");
+      return;
+    }
+  }
+  if (room_name.empty())
+    reply(TAG_OK, "Successfully left all rooms");
+  else
+    reply(TAG_ERR, "Not a member of room " + room_name);
+}
+
+void Session::handle_sender(const Message &msg) {
+  if (msg.tag == TAG_ERR) { // if an error message was received, need to return right away
+    cerr << msg.data;
+    m_state = DONE;
+  }
+  else if (msg.tag == TAG_QUIT) { // case where the sender wants to quit
+    m_conn->send(TAG_OK, "Quitting now");
+    m_state = DONE;
+  }
+  else if (m_room == nullptr) { // if the sender is not in a room, then they need to join one to send any message
+    if (msg.tag != TAG_JOIN)
+      reply(TAG_ERR, "Not a member of a room, so can't send message");
+    else { // the user did try to join a room
+      join_as_sender(msg.data);
+      reply(TAG_OK, "Successfully joined room");
+    }
+  }
+  else if (msg.tag == TAG_SENDALL) { // case where sender wants to send a message to everyone in the room
+    m_room->broadcast_message(m_user->username, m_delivery_prefix, msg.data);
+    reply(TAG_OK, "Message broadcasted in room");
+  }
+  else if (msg.tag == TAG_SENDUSER) { // a direct message: "recipient:text"
+    send_to_user(msg.data);
+  }
+  else if (msg.tag == TAG_LEAVE) { // the sender leaves their room (but doesn't quit)
+    leave_room();
+    reply(TAG_OK, "Successfully left room");
+  }
+  else if (msg.tag == TAG_JOIN) { // the sender is already in a room, so switch to the new one
+    leave_room();
+    join_as_sender(msg.data);
+    reply(TAG_OK, "Successfully joined new room");
+  }
+  else // if we get to here, then the tag was not valid
+    reply(TAG_ERR, "Invalid message tag");
+}
+
+// Deliver a direct message to every receiver logged in under the
+// recipient's name, wherever they are. It is delivered like a message
+// in the sender's room, so receivers need not tell the two apart.
+void Session::send_to_user(const string &data) {
+  size_t colon = data.find(':');
+  if (colon == string::npos || colon == 0) {
+    reply(TAG_ERR, "Invalid direct message, expected recipient:text");
+    return;
+  }
+  string recipient = data.substr(0, colon);
+  UserIndex::UserListPtr receivers = m_server->find_receivers(recipient);
+  if (receivers == nullptr) {
+    reply(TAG_ERR, "No receiver logged in as " + recipient);
+    return;
+  }
+  FramePtr frame = Room::make_delivery(m_delivery_prefix, data.substr(colon + 1));
+  for (auto &each : *receivers)
+    each->mqueue.enqueue(frame); // a full queue counts its own drops
+  reply(TAG_OK, "Message sent to " + recipient);
+}
+
+// senders are not added to the member set: they never receive
+// deliveries, so a queue for them would only grow
+void Session::join_as_sender(const string &room_name) {
+  m_room = m_server->find_or_create_room(room_name);
+  m_delivery_prefix = m_room->delivery_prefix(m_user->username);
+}
+
+void Session::reply(const char *tag, const char *data) {
+  if (!m_conn->send(tag, data))
+    m_state = DONE; // the client can't be reached any more
+}
+
+void Session::reply(const char *tag, const string &data) {
+  if (!m_conn->send(tag, data))
+    m_state = DONE; // the client can't be reached any more
+}
+
+void Session::leave_room() {
+  if (m_indexed) { // a receiver also stops getting direct messages
+    m_server->remove_receiver(m_user);
+    m_indexed = false;
+  }
+  for (Room *room : m_subscriptions) {
+    room->remove_member(m_user);
+    m_server->release_room(room); // the room goes away once nobody is in it
+  }
+  m_subscriptions.clear();
+  if (m_room != nullptr) { // a sender's room
+    m_server->release_room(m_room);
+    m_room = nullptr;
+  }
+}
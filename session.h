@@ -0,0 +1,107 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <string>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "connection.h"
+
+class Server;
+class Room;
+struct User;
+struct Message;
+struct Frame;
+
+// A Session holds the protocol state of one client connection:
+// the login, and then either the receiver's join or the sender's
+// join/sendall/leave/quit requests. It does no I/O of its own beyond
+// sending replies on its Connection, so the same state machine can be
+// driven by a blocking thread per client or by an event loop.
+class Session {
+public:
+  enum State {
+    LOGIN,         // waiting for slogin or rlogin
+    RECEIVER_JOIN, // logged in as a receiver, waiting for join
+    RECEIVER,      // receiver in a room, relaying deliveries (or polling)
+    SENDER,        // logged in as a sender
+    DONE,          // the connection should be closed
+  };
+
+  Session(Server *server, Connection *conn);
+  ~Session();
+
+  State get_state() const { return m_state; }
+  bool is_done() const { return m_state == DONE; }
+  User *get_user() const { return m_user.get(); }
+  // true once a receiver has asked to poll for its deliveries, which
+  // deliver_queued then leaves in its queue
+  bool is_polling() const { return m_polling; }
+
+  // Advance the state machine with a message received from the client.
+  void handle_message(const Message &msg);
+
+  // Handle every complete message buffered on the connection, which an
+  // event loop has filled without blocking. Returns true if the client
+  // has just joined a room as a receiver.
+  bool handle_buffered_input();
+
+  // Called when receiving a message from the client failed. A sender
+  // that sent a malformed line is told so and may continue; any other
+  // failure ends the session.
+  void handle_receive_error();
+
+  // Relay a delivery to a receiver.
+  void deliver(const Frame &frame);
+
+  // Relay the receiver's queued deliveries, stopping early once
+  // output_limit bytes are waiting to be written (which can only
+  // happen on a non-blocking connection). Deliveries are taken from the
+  // queue and written in batches of up to MAX_BATCH_FRAMES frames or
+  // MAX_BATCH_BYTES bytes. A receiver whose queue was closed for
+  // falling too far behind is disconnected.
+  void deliver_queued(size_t output_limit = SIZE_MAX);
+
+  // Leave every room the client is in, so a receiver gets no further
+  // deliveries (or direct messages).
+  void leave_room();
+
+  static const size_t MAX_BATCH_FRAMES = 256;
+  static const size_t MAX_BATCH_BYTES = 64 * 1024;
+
+private:
+  // prohibit value semantics
+  Session(const Session &);
+  Session &operator=(const Session &);
+
+  void handle_login(const Message &msg);
+  void handle_receiver_join(const Message &msg);
+  void handle_sender(const Message &msg);
+  void handle_receiver(const Message &msg);
+  void handle_poll(const Message &msg);
+  void subscribe(const std::string &request);
+  void replay(Room *room, bool since, uint64_t count);
+  void unsubscribe(const std::string &room_name);
+  bool disconnect_if_closed();
+  void join_as_sender(const std::string &room_name);
+  void send_to_user(const std::string &data);
+
+  // send a reply, ending the session if it could not be sent
+  void reply(const char *tag, const char *data);
+  void reply(const char *tag, const std::string &data);
+
+  Server *m_server;
+  Connection *m_conn;
+  State m_state;
+  std::shared_ptr<User> m_user; // shared with the member lists of rooms
+  std::vector<FramePtr> m_batch; // reused by deliver_queued
+  Message m_input; // reused by handle_buffered_input
+  Room *m_room; // a sender's room
+  std::vector<Room *> m_subscriptions; // a receiver's rooms
+  std::string m_delivery_prefix; // a sender's "room:sender:"
+  bool m_indexed; // a receiver in the server's index of receivers
+  bool m_polling;
+  bool m_greeted; // the client has sent its first message
+};
+
+#endif // SESSION_H
@@ -0,0 +1,192 @@
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include "guard.h"
+#include "slab_pool.h"
+
+namespace {
+  // more pools than the server has kinds of pooled objects
+  const unsigned MAX_POOLS = 16;
+
+  size_t round_up(size_t size) {
+    const size_t align = alignof(std::max_align_t);
+    return (size + align - 1) / align * align;
+  }
+
+  // Counters written only by the thread that owns them, so counting
+  // costs no more than a plain increment, but readable by the thread
+  // reporting them.
+  void bump(std::atomic<uint64_t> &counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+}
+
+// one thread's free blocks for one pool, and its counts for the pool
+struct SlabCache {
+  SlabPool::Block *head;
+  size_t count;
+  std::atomic<uint64_t> allocs, frees;
+  std::atomic<uint64_t> hits;   // allocations served by the cache
+  std::atomic<uint64_t> misses; // allocations that had to refill it
+};
+
+namespace {
+  struct ThreadCaches;
+
+  // protects the pools' list, the threads' list, and the counts of
+  // threads that have exited
+  pthread_mutex_t g_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+  SlabPool *g_pools[MAX_POOLS];
+  unsigned g_num_pools;
+  // (never destroyed, since threads may still exit while the process does)
+  std::vector<ThreadCaches *> &g_threads = *new std::vector<ThreadCaches *>;
+
+  // Every thread's caches, one per pool. A thread's cached blocks go
+  // back to the depot when it exits, so a pool of short-lived worker
+  // threads doesn't strand them.
+  struct ThreadCaches {
+    SlabCache caches[MAX_POOLS];
+
+    ThreadCaches() : caches() {
+      Guard guard(g_pools_lock);
+      g_threads.push_back(this);
+    }
+
+    ~ThreadCaches() {
+      Guard guard(g_pools_lock);
+      for (unsigned i = 0; i < g_num_pools; i++)
+        g_pools[i]->drain(caches[i]);
+      g_threads.erase(std::find(g_threads.begin(), g_threads.end(), this));
+    }
+  };
+
+  thread_local ThreadCaches t_caches;
+}
+
+SlabPool::SlabPool(const char *name, size_t block_size)
+  : m_name(name)
+  , m_block_size(round_up(std::max(block_size, sizeof(Block))))
+  , m_allocs(0)
+  , m_frees(0)
+  , m_hits(0)
+  , m_misses(0)
+  , m_slab_bytes(0) {
+  pthread_mutex_init(&m_lock, nullptr);
+  Guard guard(g_pools_lock);
+  if (g_num_pools == MAX_POOLS) {
+    fprintf(stderr, "Too many slab pools\n");
+    abort();
+  }
+  m_id = g_num_pools;
+  g_pools[g_num_pools++] = this;
+}
+
+SlabCache &SlabPool::cache() {
+  return t_caches.caches[m_id];
+}
+
+void *SlabPool::allocate() {
+  SlabCache &c = cache();
+  if (c.head == nullptr) {
+    refill(c);
+    bump(c.misses);
+  } else {
+    bump(c.hits);
+  }
+  Block *block = c.head;
+  c.head = block->next;
+  c.count--;
+  bump(c.allocs);
+  return block;
+}
+
+void SlabPool::deallocate(void *p) {
+  SlabCache &c = cache();
+  Block *block = static_cast<Block *>(p);
+  block->next = c.head;
+  c.head = block;
+  c.count++;
+  bump(c.frees);
+  // keep a batch in hand for the next allocations and pass the rest on
+  if (c.count >= 2 * BATCH)
+    spill(c);
+}
+
+// take a batch of free blocks from the depot, or from a new slab
+void SlabPool::refill(SlabCache &c) {
+  {
+    Guard guard(m_lock);
+    if (!m_depot.empty()) {
+      FreeList list = m_depot.back();
+      m_depot.pop_back();
+      c.head = list.head;
+      c.count = list.count;
+      return;
+    }
+  }
+  size_t slab_size = m_block_size * BATCH;
+  char *slab = static_cast<char *>(malloc(slab_size));
+  if (slab == nullptr)
+    throw std::bad_alloc();
+  m_slab_bytes.fetch_add(slab_size, std::memory_order_relaxed);
+  for (size_t i = 0; i < BATCH; i++) {
+    Block *block = reinterpret_cast<Block *>(slab + i * m_block_size);
+    block->next = (i + 1 < BATCH) ? reinterpret_cast<Block *>(slab + (i + 1) * m_block_size) : nullptr;
+  }
+  c.head = reinterpret_cast<Block *>(slab);
+  c.count = BATCH;
+}
+
+// move a batch of the cache's blocks to the depot
+void SlabPool::spill(SlabCache &c) {
+  FreeList list;
+  list.head = c.head;
+  list.count = BATCH;
+  Block *last = c.head;
+  for (size_t i = 1; i < BATCH; i++)
+    last = last->next;
+  c.head = last->next;
+  c.count -= BATCH;
+  last->next = nullptr;
+  Guard guard(m_lock);
+  m_depot.push_back(list);
+}
+
+// called with the list of pools locked
+void SlabPool::drain(SlabCache &c) {
+  m_allocs += c.allocs.load();
+  m_frees += c.frees.load();
+  m_hits += c.hits.load();
+  m_misses += c.misses.load();
+  if (c.count == 0)
+    return;
+  FreeList list;
+  list.head = c.head;
+  list.count = c.count;
+  c.head = nullptr;
+  c.count = 0;
+  Guard guard(m_lock);
+  m_depot.push_back(list);
+}
+
+void SlabPool::report_all(std::ostream &out) {
+  Guard guard(g_pools_lock);
+  for (unsigned i = 0; i < g_num_pools; i++) {
+    SlabPool *pool = g_pools[i];
+    uint64_t allocs = pool->m_allocs, frees = pool->m_frees;
+    uint64_t hits = pool->m_hits, misses = pool->m_misses;
+    for (ThreadCaches *thread : g_threads) {
+      const SlabCache &c = thread->caches[i];
+      allocs += c.allocs.load(std::memory_order_relaxed);
+      frees += c.frees.load(std::memory_order_relaxed);
+      hits += c.hits.load(std::memory_order_relaxed);
+      misses += c.misses.load(std::memory_order_relaxed);
+    }
+    // a block's free may be counted before its allocation is
+    uint64_t live = allocs > frees ? allocs - frees : 0;
+    out << "pool " << pool->m_name << ": " << live << " live ("
+        << live * pool->m_block_size << " bytes), "
+        << hits << " hits, " << misses << " misses, "
+        << pool->m_slab_bytes.load() << " bytes in slabs\n";
+  }
+}
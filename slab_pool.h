@@ -0,0 +1,114 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <ostream>
+#include <vector>
+#include <pthread.h>
+
+struct SlabCache;
+
+// A SlabPool hands out fixed-size blocks carved from larger slabs, for
+// objects the server creates and destroys constantly (a Frame for
+// every broadcast, a User for every login). Each thread keeps a small
+// cache of free blocks, so most allocations and frees touch no lock at
+// all; blocks move between a thread's cache and the pool's shared
+// depot a batch at a time, so a block freed on a receiver's thread can
+// be reused by the sender that allocates the next one. Slabs are never
+// returned to the system: the pools size themselves to the peak load.
+class SlabPool {
+public:
+  // blocks move between a thread's cache and the depot this many at a time
+  static const size_t BATCH = 64;
+
+  // name is used in reports and must outlive the pool
+  SlabPool(const char *name, size_t block_size);
+
+  void *allocate();
+  void deallocate(void *p);
+
+  // return a thread's cached blocks to the depot and keep its counts
+  // (when the thread exits)
+  void drain(SlabCache &cache);
+
+  // one line per pool: live objects and their bytes, cache hits and
+  // misses, and memory held in slabs
+  static void report_all(std::ostream &out);
+
+private:
+  // pools are never destroyed (a thread may free a block while the
+  // process exits), so there is no destructor to speak of
+  SlabPool(const SlabPool &);
+  SlabPool &operator=(const SlabPool &);
+
+  struct Block { Block *next; };
+  struct FreeList {
+    Block *head;
+    size_t count;
+  };
+
+  SlabCache &cache();
+  void refill(SlabCache &cache);
+  void spill(SlabCache &cache);
+
+  const char *m_name;
+  size_t m_block_size;
+  unsigned m_id; // this pool's cache in each thread
+
+  pthread_mutex_t m_lock; // protects m_depot
+  std::vector<FreeList> m_depot; // usually BATCH blocks each
+
+  // Allocations and frees are counted by each thread in its own cache
+  // and added up when reported; these hold the counts of threads that
+  // have exited (protected by the lock on the list of pools).
+  uint64_t m_allocs, m_frees, m_hits, m_misses;
+  std::atomic<uint64_t> m_slab_bytes;
+
+  friend struct SlabCache;
+};
+
+// A standard allocator drawing from the SlabPool named by Name (a type
+// with a static name() function), for use with std::allocate_shared:
+// the object and its reference counts then share one pooled block.
+// Every type the allocator is rebound to gets a pool of its own, all
+// reported under the same name.
+template <typename T, typename Name>
+struct PoolAllocator {
+  typedef T value_type;
+
+  PoolAllocator() { }
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U, Name> &) { }
+
+  template <typename U>
+  struct rebind { typedef PoolAllocator<U, Name> other; };
+
+  static SlabPool &pool() {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned type");
+    static SlabPool *pool = new SlabPool(Name::name(), sizeof(T));
+    return *pool;
+  }
+
+  T *allocate(size_t n) {
+    if (n != 1)
+      return static_cast<T *>(::operator new(n * sizeof(T)));
+    return static_cast<T *>(pool().allocate());
+  }
+
+  void deallocate(T *p, size_t n) {
+    if (n != 1)
+      ::operator delete(p);
+    else
+      pool().deallocate(p);
+  }
+};
+
+template <typename T, typename U, typename Name>
+bool operator==(const PoolAllocator<T, Name> &, const PoolAllocator<U, Name> &) { return true; }
+template <typename T, typename U, typename Name>
+bool operator!=(const PoolAllocator<T, Name> &, const PoolAllocator<U, Name> &) { return false; }
+
+#endif // SLAB_POOL_H
@@ -0,0 +1,19 @@
+#include "stats.h"
+
+Stats g_stats;
+
+Stats::Stats()
+  : delivery_batches(0)
+  , delivered_frames(0)
+  , rejected_connections(0) {
+}
+
+void Stats::report(std::ostream &out) const {
+  uint64_t batches = delivery_batches.load();
+  uint64_t frames = delivered_frames.load();
+  out << "deliveries: " << frames << " messages in " << batches << " writes";
+  if (batches > 0)
+    out << " (" << (double) frames / batches << " per write)";
+  out << "\n";
+  out << "rejected connections: " << rejected_connections.load() << "\n";
+}
@@ -0,0 +1,33 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+// Server-wide counters, updated with relaxed atomic increments from
+// whichever thread does the work and reported by Server::report_stats.
+struct Stats {
+  // receivers' queued deliveries are written to their sockets in batches
+  std::atomic<uint64_t> delivery_batches;
+  std::atomic<uint64_t> delivered_frames;
+  // clients turned away because the server was at its connection limit
+  std::atomic<uint64_t> rejected_connections;
+
+  Stats();
+
+  void record_batch(size_t frames) {
+    delivery_batches.fetch_add(1, std::memory_order_relaxed);
+    delivered_frames.fetch_add(frames, std::memory_order_relaxed);
+  }
+
+  void record_rejection() {
+    rejected_connections.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void report(std::ostream &out) const;
+};
+
+extern Stats g_stats;
+
+#endif // STATS_H
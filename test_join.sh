@@ -0,0 +1,68 @@
+#!/bin/bash
+
+# Usage: ./test_join.sh [port] [mode]
+#
+# Checks how receivers' join requests are read: a room name may contain
+# ':', and only a trailing ":last:K" or ":since:N" asks for a replay of
+# the room's history.
+
+PORT=${1:-9000}
+MODE=${2:-threads}
+
+if ! command -v python3 > /dev/null; then
+    echo "python3 is needed to run this test"
+    exit 1
+fi
+
+./server -m ${MODE} ${PORT} &
+SERVER_PID=$!
+trap "kill -9 ${SERVER_PID} > /dev/null 2>&1" EXIT
+sleep 1
+
+python3 - ${PORT} <<'PY'
+import socket, sys, time
+port = int(sys.argv[1])
+
+def connect(login):
+    s = socket.create_connection(('localhost', port))
+    s.settimeout(5)
+    f = s.makefile('rwb', buffering=0)
+    f.write(login)
+    return f
+
+def expect(f, name, lines):
+    got = [f.readline().decode().rstrip('\n') for _ in lines]
+    if got != lines:
+        print('FAILED: %s got %s, expected %s' % (name, got, lines))
+        sys.exit(1)
+
+sender = connect(b'slogin:alice\njoin:team:x\nsendall:m1\nsendall:m2\n')
+expect(sender, 'sender', ['ok:Logged in as: alice', 'ok:Successfully joined room',
+                          'ok:Message broadcasted in room', 'ok:Message broadcasted in room'])
+
+bob = connect(b'rlogin:bob\njoin:team:x\n')
+expect(bob, 'join of a room named with a colon', ['ok:Logged in as: bob', 'ok:Successfully joined room'])
+odd = connect(b'rlogin:dan\njoin:team:last:x\n')
+expect(odd, 'join of a room named like a replay', ['ok:Logged in as: dan', 'ok:Successfully joined room'])
+time.sleep(0.2)
+
+sender.write(b'sendall:m3\n')
+expect(sender, 'sender', ['ok:Message broadcasted in room'])
+expect(bob, 'delivery to a room named with a colon', ['delivery:team:x:alice:m3'])
+
+carol = connect(b'rlogin:carol\njoin:team:x:last:2\n')
+expect(carol, 'replay of a room named with a colon',
+       ['ok:Logged in as: carol', 'delivery:team:x:alice:m2', 'delivery:team:x:alice:m3',
+        'ok:Replayed 2 messages, next sequence 3'])
+PY
+CLIENT_RETCODE=$?
+
+if ! kill -0 ${SERVER_PID} 2> /dev/null; then
+    echo "FAILED: the server died"
+    exit 1
+fi
+if [[ ${CLIENT_RETCODE} -ne 0 ]]; then
+    exit 1
+fi
+echo "PASSED"
+exit 0
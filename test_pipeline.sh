@@ -0,0 +1,77 @@
+#!/bin/bash
+
+# Usage: ./test_pipeline.sh [port] [mode] [count]
+#
+# Regression test for a server that is handed a long burst of pipelined
+# requests: one sender streams count sendall requests without waiting
+# for the replies (reading them as they come), and a client that hasn't
+# logged in streams count proto requests. The server must answer every
+# sendall, end the other connection at the second proto (a reset may
+# lose its two replies), and still be running afterwards. In coro mode each burst used to overflow the
+# executor's stack.
+
+PORT=${1:-9000}
+MODE=${2:-coro}
+COUNT=${3:-2000000}
+
+if ! command -v python3 > /dev/null; then
+    echo "python3 is needed to run this test"
+    exit 1
+fi
+
+./server -m ${MODE} ${PORT} &
+SERVER_PID=$!
+trap "kill -9 ${SERVER_PID} > /dev/null 2>&1" EXIT
+sleep 1
+
+python3 - ${PORT} ${COUNT} <<'PY'
+import socket, sys, threading
+port, count = int(sys.argv[1]), int(sys.argv[2])
+
+# send first, then count copies of request, then last; returns the
+# number of reply lines received before the server closed the connection
+def burst(first, request, last):
+    s = socket.create_connection(('localhost', port))
+    s.sendall(first)
+    def stream():
+        chunk = request * 10000
+        try:
+            for _ in range(count // 10000):
+                s.sendall(chunk)
+            s.sendall(request * (count % 10000) + last)
+        except OSError: # the server ended the connection
+            pass
+    writer = threading.Thread(target=stream)
+    writer.start()
+    replies = 0
+    try:
+        for line in s.makefile('rb'):
+            replies += 1
+    except OSError: # reset, since the server closed with requests unread
+        pass
+    writer.join()
+    return replies
+
+ok = True
+for name, first, request, last, least, most in [
+        ('sender', b'slogin:alice\njoin:pipeline\n', b'sendall:pipelined message\n', b'quit:bye\n',
+         count + 3, count + 3), # login, join and quit too
+        ('login', b'', b'proto:1\n', b'quit:bye\n',
+         0, 2)]: # ok to the first, then an error
+    replies = burst(first, request, last)
+    print('%s: %d replies, expected %d' % (name, replies, most))
+    ok = ok and least <= replies <= most
+sys.exit(0 if ok else 1)
+PY
+CLIENT_RETCODE=$?
+
+if ! kill -0 ${SERVER_PID} 2> /dev/null; then
+    echo "FAILED: the server died"
+    exit 1
+fi
+if [[ ${CLIENT_RETCODE} -ne 0 ]]; then
+    echo "FAILED: replies missing"
+    exit 1
+fi
+echo "PASSED"
+exit 0
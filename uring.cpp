@@ -0,0 +1,204 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "uring.h"
+
+namespace {
+  int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+  }
+
+  int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+  }
+
+  int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+  }
+
+  template <typename T>
+  T *at(void *base, unsigned offset) {
+    return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+  }
+}
+
+IoUring::IoUring()
+  : m_fd(-1)
+  , m_rings(MAP_FAILED)
+  , m_rings_size(0)
+  , m_sqes(nullptr)
+  , m_sqes_size(0)
+  , m_sq_local_tail(0)
+  , m_to_submit(0)
+  , m_buf_ring(nullptr)
+  , m_buf_ring_size(0)
+  , m_buffers(nullptr)
+  , m_buffer_count(0)
+  , m_buffer_size(0)
+  , m_buf_tail(0) {
+}
+
+IoUring::~IoUring() {
+  if (m_buf_ring != nullptr)
+    munmap(m_buf_ring, m_buf_ring_size);
+  delete[] m_buffers;
+  if (m_sqes != nullptr)
+    munmap(m_sqes, m_sqes_size);
+  if (m_rings != MAP_FAILED)
+    munmap(m_rings, m_rings_size);
+  if (m_fd >= 0)
+    close(m_fd);
+}
+
+bool IoUring::init(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // completions can outnumber submissions (a multishot receive keeps
+  // producing them), so give the completion queue more room
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+  params.cq_entries = entries * 4;
+  m_fd = io_uring_setup(entries, &params);
+  if (m_fd < 0 && errno == EINVAL) { // a kernel without cooperative task running
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    m_fd = io_uring_setup(entries, &params);
+  }
+  if (m_fd < 0)
+    return false;
+  // older kernels map the two queues separately, which we don't bother with
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+    return false;
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  m_rings_size = sq_size > cq_size ? sq_size : cq_size;
+  m_rings = mmap(nullptr, m_rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 m_fd, IORING_OFF_SQ_RING);
+  if (m_rings == MAP_FAILED)
+    return false;
+  m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    m_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    return false;
+  m_sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+  m_sq_head = at<std::atomic<unsigned> >(m_rings, params.sq_off.head);
+  m_sq_tail = at<std::atomic<unsigned> >(m_rings, params.sq_off.tail);
+  m_sq_array = at<unsigned>(m_rings, params.sq_off.array);
+  m_sq_mask = *at<unsigned>(m_rings, params.sq_off.ring_mask);
+  m_sq_entries = params.sq_entries;
+  m_sq_local_tail = m_sq_tail->load(std::memory_order_relaxed);
+  // entry i of the submission queue is always sqes[i]
+  for (unsigned i = 0; i < m_sq_entries; i++)
+    m_sq_array[i] = i;
+  m_cq_head = at<std::atomic<unsigned> >(m_rings, params.cq_off.head);
+  m_cq_tail = at<std::atomic<unsigned> >(m_rings, params.cq_off.tail);
+  m_cqes = at<struct io_uring_cqe>(m_rings, params.cq_off.cqes);
+  m_cq_mask = *at<unsigned>(m_rings, params.cq_off.ring_mask);
+  return true;
+}
+
+bool IoUring::setup_buffers(unsigned count, unsigned size, uint16_t group) {
+  m_buf_ring_size = count * sizeof(struct io_uring_buf);
+  void *ring = mmap(nullptr, m_buf_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED)
+    return false;
+  m_buf_ring = static_cast<struct io_uring_buf_ring *>(ring);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) ring;
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return false;
+
+  m_buffers = new char[(size_t) count * size];
+  m_buffer_count = count;
+  m_buffer_size = size;
+  for (unsigned bid = 0; bid < count; bid++)
+    recycle_buffer(bid);
+  return true;
+}
+
+struct io_uring_sqe *IoUring::get_sqe() {
+  while (m_sq_local_tail - m_sq_head->load(std::memory_order_acquire) >= m_sq_entries) {
+    if (!submit_and_wait(0))
+      return nullptr;
+  }
+  struct io_uring_sqe *sqe = &m_sqes[m_sq_local_tail & m_sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  m_sq_local_tail++;
+  m_to_submit++;
+  return sqe;
+}
+
+bool IoUring::submit_and_wait(unsigned wait_nr) {
+  // publish the new entries to the kernel
+  m_sq_tail->store(m_sq_local_tail, std::memory_order_release);
+  while (true) {
+    // don't wait while completions set aside are still to be consumed
+    unsigned wait = m_set_aside.empty() ? wait_nr : 0;
+    int n = io_uring_enter(m_fd, m_to_submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (n >= 0) {
+      m_to_submit -= (unsigned) n;
+      return true;
+    }
+    if (errno == EINTR)
+      continue;
+    // The completion queue is full (or has overflowed), so nothing more
+    // is taken until completions are consumed: make room, then retry.
+    if ((errno == EAGAIN || errno == EBUSY) && set_aside_completions() > 0)
+      continue;
+    return false;
+  }
+}
+
+size_t IoUring::set_aside_completions() {
+  // completions the queue had no room for only come back into it
+  // when asked for, so ask if it looks empty
+  if (m_cq_head->load(std::memory_order_relaxed) == m_cq_tail->load(std::memory_order_acquire))
+    io_uring_enter(m_fd, 0, 0, IORING_ENTER_GETEVENTS);
+  size_t count = 0;
+  unsigned head = m_cq_head->load(std::memory_order_relaxed);
+  unsigned tail = m_cq_tail->load(std::memory_order_acquire);
+  for (; head != tail; head++, count++)
+    m_set_aside.push_back(m_cqes[head & m_cq_mask]);
+  m_cq_head->store(head, std::memory_order_release);
+  return count;
+}
+
+struct io_uring_cqe *IoUring::peek_cqe() {
+  if (!m_set_aside.empty())
+    return &m_set_aside.front();
+  unsigned head = m_cq_head->load(std::memory_order_relaxed);
+  if (head == m_cq_tail->load(std::memory_order_acquire))
+    return nullptr;
+  return &m_cqes[head & m_cq_mask];
+}
+
+void IoUring::cqe_seen() {
+  if (!m_set_aside.empty()) {
+    m_set_aside.pop_front();
+    return;
+  }
+  m_cq_head->store(m_cq_head->load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void IoUring::recycle_buffer(uint16_t bid) {
+  // Not m_buf_ring->bufs: compiled as C++, the header's flexible array
+  // sits behind an empty struct that takes up space, so it is misplaced.
+  struct io_uring_buf *buf = reinterpret_cast<struct io_uring_buf *>(m_buf_ring)
+    + (m_buf_tail & (m_buffer_count - 1));
+  buf->addr = (uint64_t) (uintptr_t) buffer(bid);
+  buf->len = m_buffer_size;
+  buf->bid = bid;
+  m_buf_tail++;
+  // the tail shares its place with the first buffer's reserved field
+  __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
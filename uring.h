@@ -0,0 +1,92 @@
+#ifndef URING_H
+#define URING_H
+
+#include <atomic>
+#include <deque>
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+// A minimal io_uring instance, set up with the raw system calls so
+// that the server doesn't depend on liburing. It is used by one thread
+// at a time: submission entries are filled in with get_sqe, handed to
+// the kernel (and completions waited for) with submit_and_wait, and
+// completions are consumed with peek_cqe and cqe_seen.
+//
+// If the completion queue fills up, the kernel stops taking new
+// submissions until completions are consumed. The ring then copies the
+// waiting completions out to a list of its own, which peek_cqe hands
+// out first, and submits again.
+//
+// The ring can also own a provided buffer ring: a set of equally sized
+// buffers the kernel picks from for receives with IOSQE_BUFFER_SELECT,
+// reporting the chosen buffer's id in the completion. A buffer goes
+// back to the kernel with recycle_buffer once its data is consumed.
+class IoUring {
+public:
+  IoUring();
+  ~IoUring();
+
+  // Create the ring with room for entries submissions; returns false
+  // (leaving the object unusable) if the kernel doesn't support it.
+  bool init(unsigned entries);
+
+  // Register count buffers of size bytes each (count must be a power
+  // of two) as buffer group group. Returns false if not supported.
+  bool setup_buffers(unsigned count, unsigned size, uint16_t group);
+
+  // A zeroed submission entry, submitting what is queued first if the
+  // submission queue is full.
+  struct io_uring_sqe *get_sqe();
+
+  // Submit every queued entry and wait until at least wait_nr
+  // completions are available (or any have been set aside). Returns
+  // false on an unexpected error, or if the kernel keeps refusing the
+  // entries with no completions to make room.
+  bool submit_and_wait(unsigned wait_nr);
+
+  // The oldest unconsumed completion, or nullptr if there are none.
+  struct io_uring_cqe *peek_cqe();
+  void cqe_seen();
+
+  char *buffer(uint16_t bid) const { return m_buffers + (size_t) bid * m_buffer_size; }
+  void recycle_buffer(uint16_t bid);
+
+private:
+  // prohibit value semantics
+  IoUring(const IoUring &);
+  IoUring &operator=(const IoUring &);
+
+  // move the completion queue's entries to m_set_aside; returns how many
+  size_t set_aside_completions();
+
+  int m_fd;
+
+  // the mapped submission queue, its entries, and the completion queue
+  void *m_rings;
+  size_t m_rings_size;
+  struct io_uring_sqe *m_sqes;
+  size_t m_sqes_size;
+  std::atomic<unsigned> *m_sq_head;
+  std::atomic<unsigned> *m_sq_tail;
+  unsigned *m_sq_array;
+  unsigned m_sq_mask;
+  unsigned m_sq_entries;
+  unsigned m_sq_local_tail; // entries filled in but not yet published
+  unsigned m_to_submit;
+  std::atomic<unsigned> *m_cq_head;
+  std::atomic<unsigned> *m_cq_tail;
+  struct io_uring_cqe *m_cqes;
+  unsigned m_cq_mask;
+  std::deque<struct io_uring_cqe> m_set_aside; // older than those in the queue
+
+  // the provided buffer ring and the buffers it hands out
+  struct io_uring_buf_ring *m_buf_ring;
+  size_t m_buf_ring_size;
+  char *m_buffers;
+  unsigned m_buffer_count;
+  unsigned m_buffer_size;
+  uint16_t m_buf_tail;
+};
+
+#endif // URING_H
@@ -0,0 +1,475 @@
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <iostream>
+#include "message.h"
+#include "message_queue.h"
+#include "connection.h"
+#include "session.h"
+#include "user.h"
+#include "guard.h"
+#include "server.h"
+#include "uring_loop.h"
+
+using std::cerr;
+
+// stop moving deliveries into a receiver's output buffer once this
+// much is waiting for the socket; the rest stays in its queue
+static const size_t OUTPUT_HIGH_WATER = 64 * 1024;
+
+// submission queue entries (the completion queue gets four times as many)
+static const unsigned RING_ENTRIES = 1024;
+
+// the provided buffers multishot receives fill
+static const unsigned RECV_BUFFERS = 256;
+static const unsigned RECV_BUFFER_SIZE = 8192;
+static const uint16_t RECV_GROUP = 0;
+
+// The user_data of a completion is the channel it belongs to, with the
+// low bits saying which operation completed. Zero is the wakeup read.
+enum {
+  OP_CANCEL = 0, // cancelling a receive; nothing to do when it completes
+  OP_RECV = 1,
+  OP_SEND = 2,
+  OP_POLL = 3, // waiting for a full socket to become writable
+  OP_MASK = 3,
+};
+
+// everything the loop knows about one client connection
+struct UringChannel {
+  Connection conn;
+  Session session;
+  std::string sending; // output handed to the ring
+  size_t sent;         // how much of it the socket has taken
+  bool recv_armed;     // a multishot receive is active
+  bool input_paused;   // not receiving until the output drains
+  bool send_inflight;
+  bool poll_inflight;
+  bool queue_registered; // set once the receiver has joined its room
+  bool closing;
+  bool final_sent; // closing, and no more output can be sent
+  bool shut;       // the socket has been shut down
+
+  UringChannel(Server *server, int fd)
+    : conn(fd), session(server, &conn), sent(0), recv_armed(false), input_paused(false)
+    , send_inflight(false), poll_inflight(false), queue_registered(false)
+    , closing(false), final_sent(false), shut(false) {
+    // replies and deliveries only ever go to the output buffer; the
+    // loop takes it from there
+    conn.cork();
+  }
+};
+
+static uint64_t tag(UringChannel *ch, int op) {
+  return (uint64_t) (uintptr_t) ch | op;
+}
+
+// output the socket hasn't taken yet, in the ring's hands or not
+static size_t unsent(UringChannel *ch) {
+  return ch->sending.size() - ch->sent + ch->conn.pending_output();
+}
+
+UringLoop::UringLoop(Server *server)
+  : m_server(server), m_wakefd(-1), m_wake_count(0) {
+  pthread_mutex_init(&m_lock, nullptr);
+}
+
+UringLoop::~UringLoop() {
+  // the loop threads run for the life of the server, so there is
+  // nothing to join; just release the descriptor
+  if (m_wakefd >= 0)
+    close(m_wakefd);
+  pthread_mutex_destroy(&m_lock);
+}
+
+bool UringLoop::supported() {
+  IoUring ring;
+  if (!ring.init(4) || !ring.setup_buffers(2, 64, RECV_GROUP))
+    return false;
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    return false;
+  // a multishot receive must take a provided buffer and stay armed
+  struct io_uring_sqe *sqe = ring.get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fds[0];
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECV_GROUP;
+  sqe->user_data = 1;
+  bool ok = false;
+  if (write(fds[1], "x", 1) == 1 && ring.submit_and_wait(1)) {
+    struct io_uring_cqe *cqe = ring.peek_cqe();
+    ok = cqe != nullptr && cqe->res == 1
+      && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE);
+  }
+  // closing the ring cancels the receive
+  close(fds[0]);
+  close(fds[1]);
+  return ok;
+}
+
+bool UringLoop::start() {
+  // The eventfd stays blocking: the ring then waits for it to become
+  // readable, instead of completing the read at once with EAGAIN.
+  m_wakefd = eventfd(0, EFD_CLOEXEC);
+  if (m_wakefd < 0 || !m_ring.init(RING_ENTRIES)
+      || !m_ring.setup_buffers(RECV_BUFFERS, RECV_BUFFER_SIZE, RECV_GROUP)) {
+    cerr << "Failed to create io_uring event loop\n";
+    return false;
+  }
+  if (!arm_wake()) {
+    cerr << "Failed to register event loop wakeup\n";
+    return false;
+  }
+  if (pthread_create(&m_thread, nullptr, run, this) != 0) {
+    cerr << "Failed to create event loop thread\n";
+    return false;
+  }
+  pthread_detach(m_thread);
+  return true;
+}
+
+void UringLoop::add_connection(int fd) {
+  {
+    Guard guard(m_lock);
+    m_incoming.push_back(fd);
+  }
+  wake();
+}
+
+void *UringLoop::run(void *arg) {
+  static_cast<UringLoop *>(arg)->loop();
+  return nullptr;
+}
+
+// Called on a sender's thread when a receiver's queue becomes non-empty.
+// Only the first queue to become ready since the loop last looked wakes it.
+void UringLoop::notify_ready(void *arg, MessageQueue *queue) {
+  UringLoop *loop = static_cast<UringLoop *>(arg);
+  bool first;
+  {
+    Guard guard(loop->m_lock);
+    first = loop->m_ready.empty();
+    loop->m_ready.push_back(queue);
+  }
+  if (first)
+    loop->wake();
+}
+
+void UringLoop::loop() {
+  while (true) {
+    // submit everything queued during the last pass in one go
+    if (!m_ring.submit_and_wait(1)) {
+      cerr << "io_uring_enter failed\n";
+      return;
+    }
+    struct io_uring_cqe *cqe;
+    while ((cqe = m_ring.peek_cqe()) != nullptr) {
+      uint64_t data = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      m_ring.cqe_seen();
+      if (data == 0) { // woken by an acceptor or a sender
+        handle_wake();
+        continue;
+      }
+      UringChannel *ch = reinterpret_cast<UringChannel *>((uintptr_t) (data & ~(uint64_t) OP_MASK));
+      switch (data & OP_MASK) {
+      case OP_RECV:
+        handle_recv(ch, res, flags);
+        break;
+      case OP_SEND:
+        handle_send(ch, res);
+        break;
+      case OP_POLL:
+        handle_poll(ch);
+        break;
+      }
+    }
+    // the buffers consumed above are back in the ring by now
+    for (UringChannel *ch : m_rearm) {
+      if (!ch->closing && !ch->recv_armed && !ch->input_paused && !arm_recv(ch))
+        close_channel(ch);
+    }
+    m_rearm.clear();
+    reap_closed();
+  }
+}
+
+void UringLoop::wake() {
+  uint64_t one = 1;
+  ssize_t rc = write(m_wakefd, &one, sizeof(one));
+  (void) rc; // the counter can't realistically overflow
+}
+
+bool UringLoop::arm_wake() {
+  struct io_uring_sqe *sqe = m_ring.get_sqe();
+  if (sqe == nullptr)
+    return false;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = m_wakefd;
+  sqe->addr = (uint64_t) (uintptr_t) &m_wake_count;
+  sqe->len = sizeof(m_wake_count);
+  sqe->user_data = 0;
+  return true;
+}
+
+void UringLoop::handle_wake() {
+  std::vector<int> incoming;
+  {
+    Guard guard(m_lock);
+    incoming.swap(m_incoming);
+    m_ready_batch.swap(m_ready);
+  }
+  if (!arm_wake())
+    cerr << "Failed to rearm event loop wakeup\n";
+
+  for (int fd : incoming) {
+    UringChannel *ch = new UringChannel(m_server, fd);
+    if (!arm_recv(ch)) {
+      cerr << "Failed to register client connection\n";
+      delete ch;
+      m_server->connection_closed();
+    }
+  }
+  for (MessageQueue *queue : m_ready_batch) {
+    auto it = m_queues.find(queue);
+    if (it != m_queues.end()) // otherwise its receiver has gone
+      deliver(it->second);
+  }
+  m_ready_batch.clear();
+}
+
+bool UringLoop::arm_recv(UringChannel *ch) {
+  struct io_uring_sqe *sqe = m_ring.get_sqe();
+  if (sqe == nullptr)
+    return false;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = ch->conn.get_fd();
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECV_GROUP;
+  sqe->user_data = tag(ch, OP_RECV);
+  ch->recv_armed = true;
+  return true;
+}
+
+void UringLoop::handle_recv(UringChannel *ch, int res, unsigned flags) {
+  if (!(flags & IORING_CQE_F_MORE))
+    ch->recv_armed = false;
+  if (res == -ENOBUFS) { // every buffer is in use; try again after this pass
+    if (!ch->closing)
+      m_rearm.push_back(ch);
+    return;
+  }
+  if (res == -ECANCELED) { // by pause_input
+    if (!ch->closing && !ch->input_paused) // the output drained meanwhile
+      m_rearm.push_back(ch);
+    return;
+  }
+  if (res <= 0) { // EOF or an error
+    if (!ch->closing) {
+      ch->conn.feed_eof();
+      if (!ch->session.is_done())
+        ch->session.handle_receive_error(); // exactly like the other modes
+      close_channel(ch);
+    }
+    return;
+  }
+  uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+  if (!ch->closing)
+    handle_input(ch, m_ring.buffer(bid), res);
+  m_ring.recycle_buffer(bid);
+  if (!ch->recv_armed && !ch->closing)
+    m_rearm.push_back(ch);
+}
+
+void UringLoop::handle_input(UringChannel *ch, const char *data, size_t len) {
+  // handle every complete message, a buffer's worth of input at a time
+  while (len > 0 && !ch->session.is_done()) {
+    size_t n = ch->conn.feed(data, len);
+    data += n;
+    len -= n;
+    ch->session.handle_buffered_input();
+    if (n == 0) // can't happen: a full buffer is always consumed
+      break;
+  }
+  if (ch->session.is_done()) {
+    close_channel(ch);
+    return;
+  }
+  if (ch->session.get_state() == Session::RECEIVER && !ch->queue_registered) {
+    // the receiver has joined its room: from now on its queue wakes us
+    MessageQueue *queue = &ch->session.get_user()->mqueue;
+    m_queues[queue] = ch;
+    queue->set_notify(notify_ready, this);
+    ch->queue_registered = true;
+    deliver(ch); // in case deliveries arrived before the notification was set
+    return;
+  }
+  start_send(ch);
+  if (unsent(ch) >= OUTPUT_HIGH_WATER)
+    pause_input(ch);
+}
+
+// Stop receiving while more than OUTPUT_HIGH_WATER of output is waiting
+// for the socket, as an EventLoop drops EPOLLIN: a client pipelining
+// requests without reading the replies is left to fill the socket's
+// buffers rather than ours. handle_send resumes once the output drains.
+// (A multishot receive can't be paused, so it is cancelled.)
+void UringLoop::pause_input(UringChannel *ch) {
+  if (ch->input_paused || ch->closing)
+    return;
+  ch->input_paused = true;
+  if (!ch->recv_armed)
+    return;
+  struct io_uring_sqe *sqe = m_ring.get_sqe();
+  if (sqe == nullptr) {
+    close_channel(ch);
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = tag(ch, OP_RECV);
+  sqe->user_data = tag(ch, OP_CANCEL);
+}
+
+void UringLoop::resume_input(UringChannel *ch) {
+  ch->input_paused = false;
+  if (!ch->recv_armed) // otherwise the cancelled receive comes back first
+    m_rearm.push_back(ch);
+}
+
+// Hand the channel's output to the ring, unless a send or a wait for
+// the socket is already in flight (its completion comes back here).
+// Returns true if a send was submitted.
+bool UringLoop::start_send(UringChannel *ch) {
+  if (ch->send_inflight || ch->poll_inflight)
+    return false;
+  if (ch->sent == ch->sending.size()) {
+    ch->conn.take_output(ch->sending);
+    ch->sent = 0;
+    if (ch->sending.empty())
+      return false;
+  }
+  struct io_uring_sqe *sqe = m_ring.get_sqe();
+  if (sqe == nullptr) {
+    if (!ch->closing)
+      close_channel(ch);
+    return false;
+  }
+  // Sends never wait: if the socket is full, the send fails with
+  // EAGAIN and handle_send waits for room with a poll, which (unlike a
+  // send) can be ended at any time by shutting the socket down.
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = ch->conn.get_fd();
+  sqe->addr = (uint64_t) (uintptr_t) (ch->sending.data() + ch->sent);
+  sqe->len = ch->sending.size() - ch->sent;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+  sqe->user_data = tag(ch, OP_SEND);
+  ch->send_inflight = true;
+  return true;
+}
+
+void UringLoop::handle_send(UringChannel *ch, int res) {
+  ch->send_inflight = false;
+  if (ch->closing) {
+    if (res > 0)
+      ch->sent += res;
+    else // the socket is full or gone: whatever is left is dropped
+      ch->final_sent = true;
+    finish_close(ch);
+    return;
+  }
+  if (res == -EAGAIN) { // the socket is full: wait until it drains
+    struct io_uring_sqe *sqe = m_ring.get_sqe();
+    if (sqe == nullptr) {
+      close_channel(ch);
+      return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ch->conn.get_fd();
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = tag(ch, OP_POLL);
+    ch->poll_inflight = true;
+    return;
+  }
+  if (res < 0) { // the client can't be reached any more
+    close_channel(ch);
+    return;
+  }
+  ch->sent += res;
+  if (ch->input_paused && unsent(ch) < OUTPUT_HIGH_WATER)
+    resume_input(ch);
+  if (ch->sent < ch->sending.size())
+    start_send(ch); // the rest of it
+  else if (ch->session.get_state() == Session::RECEIVER)
+    deliver(ch); // there may be more waiting now that the socket drained
+  else
+    start_send(ch); // replies written while this send was in flight
+}
+
+void UringLoop::handle_poll(UringChannel *ch) {
+  ch->poll_inflight = false;
+  if (ch->closing)
+    finish_close(ch);
+  else
+    start_send(ch);
+}
+
+// move pending deliveries from the receiver's queue to its socket
+void UringLoop::deliver(UringChannel *ch) {
+  if (ch->closing)
+    return;
+  ch->session.deliver_queued(OUTPUT_HIGH_WATER);
+  if (ch->session.is_done())
+    close_channel(ch);
+  else
+    start_send(ch);
+}
+
+void UringLoop::close_channel(UringChannel *ch) {
+  if (ch->closing)
+    return;
+  ch->closing = true;
+  if (ch->queue_registered)
+    m_queues.erase(&ch->session.get_user()->mqueue);
+  m_closing.push_back(ch);
+  finish_close(ch);
+}
+
+// Send what output is left (such as the reply to a quit) for as long
+// as the socket takes it without waiting, then shut the socket down,
+// which ends its receive and any wait for room.
+void UringLoop::finish_close(UringChannel *ch) {
+  if (ch->send_inflight)
+    return; // it doesn't wait, so it comes back here soon
+  if (!ch->poll_inflight && !ch->final_sent) {
+    if (start_send(ch))
+      return;
+    ch->final_sent = true; // nothing left
+  }
+  if (!ch->shut) {
+    shutdown(ch->conn.get_fd(), SHUT_RDWR);
+    ch->shut = true;
+  }
+}
+
+void UringLoop::reap_closed() {
+  size_t kept = 0;
+  for (UringChannel *ch : m_closing) {
+    if (ch->recv_armed || ch->send_inflight || ch->poll_inflight) {
+      m_closing[kept++] = ch; // the ring still refers to it
+      continue;
+    }
+    // drop unsent output, so closing the connection doesn't wait to write it
+    std::string unsent;
+    ch->conn.take_output(unsent);
+    delete ch; // the session leaves its room as it is destroyed
+    m_server->connection_closed();
+  }
+  m_closing.resize(kept);
+}
@@ -0,0 +1,85 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <pthread.h>
+#include "uring.h"
+
+class Server;
+class MessageQueue;
+struct UringChannel;
+
+// A UringLoop is the io_uring counterpart of an EventLoop: a thread
+// that drives many client Sessions, but through one io_uring instead
+// of epoll. Each socket has a multishot receive that takes its buffers
+// from a provided buffer ring, so data arrives without a read call
+// per message, and every send queued during one pass of the loop is
+// submitted together with a single io_uring_enter.
+//
+// Receivers' queues don't wake the loop through their own eventfds:
+// a queue calls back into the loop (see MessageQueue::set_notify),
+// which gathers all the receivers with new deliveries and is woken at
+// most once for the lot, so a broadcast to a large room costs a handful
+// of system calls instead of several per member.
+class UringLoop {
+public:
+  UringLoop(Server *server);
+  ~UringLoop();
+
+  // Whether this kernel supports what the loop needs (multishot
+  // receive with a provided buffer ring), checked by trying it out.
+  static bool supported();
+
+  // set up the ring and start the loop thread
+  bool start();
+
+  // Hand an accepted (blocking) socket to this loop. Safe to call from
+  // any thread.
+  void add_connection(int fd);
+
+private:
+  // prohibit value semantics
+  UringLoop(const UringLoop &);
+  UringLoop &operator=(const UringLoop &);
+
+  static void *run(void *arg);
+  static void notify_ready(void *arg, MessageQueue *queue);
+  void loop();
+  void wake();
+  bool arm_wake();
+  void handle_wake();
+  bool arm_recv(UringChannel *ch);
+  void handle_recv(UringChannel *ch, int res, unsigned flags);
+  void handle_input(UringChannel *ch, const char *data, size_t len);
+  void pause_input(UringChannel *ch);
+  void resume_input(UringChannel *ch);
+  bool start_send(UringChannel *ch);
+  void handle_send(UringChannel *ch, int res);
+  void handle_poll(UringChannel *ch);
+  void deliver(UringChannel *ch);
+  void close_channel(UringChannel *ch);
+  void finish_close(UringChannel *ch);
+  void reap_closed();
+
+  Server *m_server;
+  IoUring m_ring;
+  int m_wakefd; // eventfd used to wake the loop from other threads
+  uint64_t m_wake_count; // where the ring reads the eventfd into
+  pthread_t m_thread;
+
+  pthread_mutex_t m_lock; // protects m_incoming and m_ready
+  std::vector<int> m_incoming;
+  std::vector<MessageQueue *> m_ready; // queues that became non-empty
+
+  // the receivers' queues, so a notification for a queue whose
+  // receiver has gone already can be recognized and ignored
+  std::unordered_map<MessageQueue *, UringChannel *> m_queues;
+  std::vector<MessageQueue *> m_ready_batch; // reused by handle_wake
+  std::vector<UringChannel *> m_rearm; // receives that ran out of buffers (or resume)
+  std::vector<UringChannel *> m_closing; // deleted once nothing is in flight
+};
+
+#endif // URING_LOOP_H
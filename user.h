@@ -3,14 +3,16 @@
 
 #include <string>
 #include "message_queue.h"
+#include "name.h"
 
 struct User {
-  std::string username;
+  Name username;
 
   // queue of pending messages awaiting delivery
   MessageQueue mqueue;
 
-  User(const std::string &username) : username(username) { }
+  User(const std::string &username, const MessageQueue::Limits &limits = MessageQueue::Limits())
+    : username(username), mqueue(limits) { }
 };
 
 #endif // USER_H
@@ -0,0 +1,58 @@
+#include <algorithm>
+#include "user_index.h"
+#include "user.h"
+#include "guard.h"
+
+UserIndex::UserIndex() {
+  for (size_t i = 0; i < NUM_SHARDS; i++)
+    pthread_rwlock_init(&m_shards[i].lock, nullptr);
+}
+
+UserIndex::~UserIndex() {
+  for (size_t i = 0; i < NUM_SHARDS; i++)
+    pthread_rwlock_destroy(&m_shards[i].lock);
+}
+
+UserIndex::Shard &UserIndex::shard_for(const std::string &name) {
+  return m_shards[std::hash<std::string>()(name) % NUM_SHARDS];
+}
+
+void UserIndex::add(const std::shared_ptr<User> &user) {
+  const std::string &name = user->username.str();
+  Shard &shard = shard_for(name);
+  WriteGuard guard(shard.lock);
+  UserListPtr &current = shard.users[name];
+  std::shared_ptr<UserList> updated = current ? std::make_shared<UserList>(*current)
+                                              : std::make_shared<UserList>();
+  updated->push_back(user);
+  current = updated;
+}
+
+void UserIndex::remove(const std::shared_ptr<User> &user) {
+  const std::string &name = user->username.str();
+  Shard &shard = shard_for(name);
+  WriteGuard guard(shard.lock);
+  auto entry = shard.users.find(name);
+  if (entry == shard.users.end())
+    return;
+  const UserList &current = *entry->second;
+  if (std::find(current.begin(), current.end(), user) == current.end())
+    return;
+  if (current.size() == 1) { // the name's last receiver
+    shard.users.erase(entry);
+    return;
+  }
+  std::shared_ptr<UserList> updated = std::make_shared<UserList>();
+  updated->reserve(current.size() - 1);
+  for (auto &each : current)
+    if (each != user)
+      updated->push_back(each);
+  entry->second = updated;
+}
+
+UserIndex::UserListPtr UserIndex::find(const std::string &name) {
+  Shard &shard = shard_for(name);
+  ReadGuard guard(shard.lock);
+  auto entry = shard.users.find(name);
+  return (entry == shard.users.end()) ? nullptr : entry->second;
+}
@@ -0,0 +1,53 @@
+#ifndef USER_INDEX_H
+#define USER_INDEX_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <pthread.h>
+
+struct User;
+
+// The server's receivers, looked up by user name, so that a direct
+// message finds its recipient without searching every room. Names are
+// hashed to one of a fixed number of shards, each with its own
+// reader/writer lock, as in RoomRegistry. Several receivers may be
+// logged in under one name; each name's receivers are a copy-on-write
+// list, like a Room's members, so a lookup only copies a pointer and
+// delivering to the list needs no lock at all.
+class UserIndex {
+public:
+  static const size_t NUM_SHARDS = 64;
+
+  typedef std::vector<std::shared_ptr<User> > UserList;
+  typedef std::shared_ptr<const UserList> UserListPtr;
+
+  UserIndex();
+  ~UserIndex();
+
+  void add(const std::shared_ptr<User> &user);
+  void remove(const std::shared_ptr<User> &user);
+
+  // the receivers logged in as name, or nullptr if there are none
+  UserListPtr find(const std::string &name);
+
+private:
+  // value semantics prohibited
+  UserIndex(const UserIndex &);
+  UserIndex &operator=(const UserIndex &);
+
+  typedef std::unordered_map<std::string, UserListPtr> UserMap;
+
+  struct Shard {
+    pthread_rwlock_t lock;
+    UserMap users;
+    char pad[64]; // keep neighbouring shards' locks off each other's cache lines
+  };
+
+  Shard &shard_for(const std::string &name);
+
+  Shard m_shards[NUM_SHARDS];
+};
+
+#endif // USER_INDEX_H
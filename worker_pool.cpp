@@ -0,0 +1,121 @@
+#include <unistd.h>
+#include <iostream>
+#include <memory>
+#include "guard.h"
+#include "worker_pool.h"
+
+using std::cerr;
+
+WorkerPool::WorkerPool(Handler handler, void *arg, size_t num_workers,
+                       size_t queue_capacity, size_t stack_size)
+  : m_handler(handler)
+  , m_arg(arg)
+  , m_num_workers(num_workers)
+  , m_queue_capacity(queue_capacity)
+  , m_stack_size(stack_size)
+  , m_idle(0) {
+  pthread_mutex_init(&m_lock, nullptr);
+  pthread_cond_init(&m_ready, nullptr);
+}
+
+WorkerPool::~WorkerPool() {
+  // the workers run for the life of the server, so there is nothing
+  // to join; connections still queued are closed
+  for (int fd : m_pending)
+    close(fd);
+  pthread_cond_destroy(&m_ready);
+  pthread_mutex_destroy(&m_lock);
+}
+
+namespace {
+  // what a thread serving one connection is handed
+  struct OneConnection {
+    WorkerPool::Handler handler;
+    void *arg;
+    int fd;
+  };
+}
+
+bool WorkerPool::start() {
+  if (m_stack_size > 0) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (pthread_attr_setstacksize(&attr, m_stack_size) != 0) {
+      cerr << "Invalid worker stack size " << m_stack_size << ", using the default\n";
+      m_stack_size = 0;
+    }
+    pthread_attr_destroy(&attr);
+  }
+  if (m_num_workers == 0) // threads are started as clients arrive
+    return true;
+  for (size_t i = 0; i < m_num_workers; i++) {
+    pthread_t thread;
+    if (!create_thread(run, this, thread)) {
+      cerr << "Failed to create worker thread, continuing with " << i << " workers\n";
+      break;
+    }
+    m_threads.push_back(thread);
+  }
+  return !m_threads.empty();
+}
+
+bool WorkerPool::create_thread(void *(*fn)(void *), void *arg, pthread_t &thread) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (m_stack_size > 0)
+    pthread_attr_setstacksize(&attr, m_stack_size);
+  bool created = pthread_create(&thread, &attr, fn, arg) == 0;
+  pthread_attr_destroy(&attr);
+  return created;
+}
+
+bool WorkerPool::submit(int fd) {
+  if (m_num_workers == 0) {
+    OneConnection *one = new OneConnection{ m_handler, m_arg, fd };
+    pthread_t thread;
+    if (!create_thread(run_one, one, thread)) {
+      cerr << "Failed to create a thread for a client\n";
+      delete one;
+      return false;
+    }
+    return true;
+  }
+  {
+    Guard guard(m_lock);
+    // idle workers will take queued connections right away, so only
+    // those beyond them count against the queue's capacity
+    if (m_pending.size() >= m_idle + m_queue_capacity)
+      return false;
+    m_pending.push_back(fd);
+  }
+  pthread_cond_signal(&m_ready);
+  return true;
+}
+
+void *WorkerPool::run(void *arg) {
+  static_cast<WorkerPool *>(arg)->loop();
+  return nullptr;
+}
+
+void *WorkerPool::run_one(void *arg) {
+  std::unique_ptr<OneConnection> one(static_cast<OneConnection *>(arg));
+  one->handler(one->arg, one->fd);
+  return nullptr;
+}
+
+void WorkerPool::loop() {
+  while (true) {
+    int fd;
+    {
+      Guard guard(m_lock);
+      m_idle++;
+      while (m_pending.empty())
+        pthread_cond_wait(&m_ready, &m_lock);
+      m_idle--;
+      fd = m_pending.front();
+      m_pending.pop_front();
+    }
+    m_handler(m_arg, fd);
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+// A fixed set of threads serving accepted client connections, one
+// connection per thread at a time. Up to queue_capacity connections
+// that arrive while every worker is busy wait for one to finish;
+// beyond that, submit refuses them so the acceptor can turn the
+// client away.
+//
+// With num_workers 0 there is no fixed set: every connection gets a
+// thread of its own, which exits when the client leaves, and nothing
+// waits in the queue.
+class WorkerPool {
+public:
+  // called on a worker thread to serve the client connected on fd
+  typedef void (*Handler)(void *arg, int fd);
+
+  // stack_size is in bytes, 0 for the system default
+  WorkerPool(Handler handler, void *arg, size_t num_workers,
+             size_t queue_capacity, size_t stack_size);
+  ~WorkerPool();
+
+  // Create the worker threads. Returns false if none could be created;
+  // if only some could, the pool carries on with those.
+  bool start();
+
+  // Queue a connection for the next free worker (or start its own
+  // thread). Returns false, without taking ownership of fd, if the queue
+  // is full (or the thread couldn't be created).
+  bool submit(int fd);
+
+  size_t get_num_workers() const { return m_threads.size(); }
+
+private:
+  // prohibit value semantics
+  WorkerPool(const WorkerPool &);
+  WorkerPool &operator=(const WorkerPool &);
+
+  static void *run(void *arg);
+  void loop();
+  // a thread serving just one connection, when num_workers is 0
+  static void *run_one(void *arg);
+  // a detached thread with the pool's stack size
+  bool create_thread(void *(*fn)(void *), void *arg, pthread_t &thread);
+
+  Handler m_handler;
+  void *m_arg;
+  size_t m_num_workers;
+  size_t m_queue_capacity;
+  size_t m_stack_size;
+  std::vector<pthread_t> m_threads;
+
+  pthread_mutex_t m_lock; // protects m_pending and m_idle
+  pthread_cond_t m_ready; // signalled when a connection is queued
+  std::deque<int> m_pending;
+  size_t m_idle; // workers waiting for a connection
+};
+
+#endif // WORKER_POOL_H